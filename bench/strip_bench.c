@@ -0,0 +1,66 @@
+// Measures data placement in the row-major layout (a module at a
+// time through the placement table) against the strip layout
+// (whole strip words, then one conversion to rows) on versions 20 - 40
+// Usage: strip_bench
+
+#include "module.c"
+
+#include "error.c"
+#include "version.c"
+
+#include <time.h>
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+#define RUNS 2000
+
+int main() {
+    static uint8_t data[3706];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = i * 131 + 7;
+
+    QrMatrix* qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+    StripMatrix strips;
+
+    printf("version  rows (us)  strips (us)  to rows (us)  speedup\n");
+
+    for (Version ver = 20; ver <= 40; ++ver) {
+        const size_t size = get_final_message_size(ver);
+
+        // Warm up the tables
+        write_qr_template(ver, qr);
+        place_data(ver, qr, data, size);
+
+        double start = now_us();
+        for (int r = 0; r < RUNS; ++r) {
+            write_qr_template(ver, qr);
+            place_data_rows(ver, qr, data, size);
+        }
+        double rows = (now_us() - start) / RUNS;
+
+        start = now_us();
+        for (int r = 0; r < RUNS; ++r) {
+            write_qr_template(ver, qr);
+            init_strip_matrix(&strips, ver);
+            place_data_strips(ver, &strips, data, size);
+        }
+        double placed = (now_us() - start) / RUNS;
+
+        start = now_us();
+        for (int r = 0; r < RUNS; ++r) {
+            write_qr_template(ver, qr);
+            place_data(ver, qr, data, size);
+        }
+        double total = (now_us() - start) / RUNS;
+
+        printf("%7u  %9.2f  %11.2f  %12.2f  %7.2f\n", ver, rows, placed, total, rows / total);
+    }
+
+    free(qr);
+
+    return 0;
+}
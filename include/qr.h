@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 typedef enum {
     ERROR_LEVEL_LOW,
@@ -13,6 +14,42 @@ typedef enum {
 
 typedef uint32_t Version;
 
+// Picks the smallest version the data fits in
+#define VERSION_AUTO ((Version)0)
+
+typedef enum {
+    MODE_ECI         = 0b0111,
+    MODE_NUMERIC     = 0b0001,
+    MODE_ALPHANUM    = 0b0010,
+    MODE_BYTE        = 0b0100,
+    MODE_KANJI       = 0b1000,
+    MODE_STRUCT_APP  = 0b0011,
+    MODE_FNC1_FIRST  = 0b0101,
+    MODE_FNC1_SECND  = 0b1001,
+
+    // Not a mode indicator: splits the data into numeric,
+    // alphanumeric and byte segments taking the fewest bits
+    MODE_AUTO        = 0b10000,
+} ModeIndicator;
+
+// How the mask pattern of a qr code is chosen
+// MASK_FIXED(n) always uses mask pattern n (0 - 7)
+typedef enum {
+    MASK_OPTIMAL = 8, // Score all 8 masks and keep the lowest penalty
+    MASK_BOUNDED = 9, // Same choice, but stop scoring a mask once it can't win
+} MaskStrategy;
+
+#define MASK_FIXED(n) ((MaskStrategy)(n))
+
+// What the mask selection did
+typedef struct {
+    uint8_t mask;           // The chosen mask pattern
+    uint32_t penalty;       // Its penalty score (0 for a fixed mask)
+    uint32_t masks_scored;  // Masks that were scored completely
+    uint32_t lines_scored;  // Rows, columns and row pairs scored
+    uint32_t lines_skipped; // The ones left out (compared to scoring all 8 masks)
+} MaskReport;
+
 typedef struct {
     Version version;
     ErrorLevel err_lvl;
@@ -23,4 +60,66 @@ typedef struct {
 Symbol create_symbol(Version version, ErrorLevel err_lvl);
 void delete_symbol(Symbol* s);
 
+// Returns the smallest version 'size' bytes of 'data' fit in, in mode
+// 'mode' at error level 'err_lvl', without encoding them
+// Returns 0 (VERSION_AUTO) if they don't fit any version
+Version qr_min_version(const uint8_t* data, size_t size, ModeIndicator mode, ErrorLevel err_lvl);
+
+// Buffer sizes for qr_encode_into()
+typedef struct {
+    size_t scratch_size; // Bytes of scratch space
+    size_t modules_size; // Bytes of the module matrix
+    uint32_t side;       // Side length of the qr code
+    uint32_t row_words;  // 64-bit words per row of the module matrix
+} QrBuffers;
+
+// Returns the buffer sizes qr_encode_into() needs for a qr
+// code of the given version and error level (all 0 if invalid)
+QrBuffers qr_buffer_requirements(Version version, ErrorLevel err_lvl);
+
+// Encodes 'size' bytes of 'data' in mode 'mode' into a qr code without
+// allocating: everything lives in 'scratch' and 'modules', which must
+// be at least as big as qr_buffer_requirements() says
+// The modules are bit-packed rows: module (x, y) is bit x % 64 of
+// modules[y * row_words + x / 64], 1 being black (see qr_get_module())
+// If 'report' is not NULL it is filled in as described in MaskReport
+// Returns false (and prints why) if the arguments are invalid
+// or the data doesn't fit (see qr_min_version())
+bool qr_encode_into(const uint8_t* data, size_t size, ModeIndicator mode, Version version, ErrorLevel err_lvl,
+    MaskStrategy strategy, void* scratch, size_t scratch_size, uint64_t* modules, size_t modules_size, MaskReport* report);
+
+// Options shared by every qr code a QrEncoder makes
+typedef struct {
+    ErrorLevel err_lvl;
+    MaskStrategy strategy;
+} QrOptions;
+
+// A qr code made by qr_encode(), which lives in the
+// encoder until its next call to qr_encode()
+typedef struct {
+    Version version;
+    const uint64_t* modules; // Bit-packed rows, as for qr_encode_into()
+    uint32_t side;
+    uint32_t row_words;
+    MaskReport report;
+} QrCode;
+
+// An encoder that reuses one buffer for every qr code it makes, so
+// encoding does not allocate. An encoder must only be used by one
+// thread at a time; make one per worker thread
+typedef struct QrEncoder QrEncoder;
+
+QrEncoder* qr_create_encoder(QrOptions options);
+void qr_delete_encoder(QrEncoder* encoder);
+
+// Encodes 'size' bytes of 'data' in mode 'mode' into 'code'
+// 'version' can be VERSION_AUTO
+// Returns false (and prints why) if the arguments are invalid
+// or the data doesn't fit
+bool qr_encode(QrEncoder* encoder, const uint8_t* data, size_t size, ModeIndicator mode, Version version, QrCode* code);
+
+static inline bool qr_get_module(const uint64_t* modules, uint32_t row_words, uint32_t x, uint32_t y) {
+    return modules[y * row_words + x / 64] >> (x % 64) & 1;
+}
+
 #endif
@@ -0,0 +1,39 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A bump allocator over a fixed buffer
+// Allocations are only freed all at once by arena_reset()
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    size_t used;
+} Arena;
+
+static inline void arena_init(Arena* arena, void* base, size_t size) {
+    arena->base = (uint8_t*)base;
+    arena->size = size;
+    arena->used = 0;
+}
+
+static inline void arena_reset(Arena* arena) {
+    arena->used = 0;
+}
+
+// Returns 'size' bytes aligned to 'align' (a power of 2),
+// or NULL if the arena is full
+static inline void* arena_alloc(Arena* arena, size_t size, size_t align) {
+    uintptr_t start = (uintptr_t)arena->base + arena->used;
+    uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+    size_t end = aligned - (uintptr_t)arena->base + size;
+
+    if (end > arena->size)
+        return NULL;
+
+    arena->used = end;
+    return (void*)aligned;
+}
+
+#endif
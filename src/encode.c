@@ -0,0 +1,195 @@
+#include "qr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "matrix.h"
+#include "version.h"
+#include "arena.h"
+
+// The stages of the pipeline (src/qr_write.c and src/module.c)
+bool encode_data_into(const uint8_t* data, size_t size, ModeIndicator mode, Version version, ErrorLevel err_lvl, uint8_t* codewords);
+size_t choose_segments(const uint8_t* data, size_t size, Version version, uint8_t* modes);
+Version choose_version(const uint8_t* data, size_t size, ModeIndicator mode, ErrorLevel err_lvl);
+bool encode_segments_into(const uint8_t* data, size_t size, const uint8_t* modes, Version version, ErrorLevel err_lvl, uint8_t* codewords);
+bool get_final_message_into(const uint8_t* msg, size_t msg_len, Version ver, ErrorLevel lvl, uint8_t* final);
+bool create_qr_into(Version ver, ErrorLevel lvl, MaskStrategy strategy, uint8_t* data, size_t size, QrMatrix* qr, QrMatrix* candidate, MaskReport* report);
+
+static bool is_valid(Version version, ErrorLevel err_lvl) {
+    return version >= 1 && version <= 40 && err_lvl >= ERROR_LEVEL_LOW && err_lvl <= ERROR_LEVEL_HIGH;
+}
+
+// The most characters a qr code can hold: every
+// character takes at least 10/3 bits (numeric mode)
+static size_t max_char_cnt(Version version, ErrorLevel err_lvl) {
+    return get_version_info(version)->capacity[err_lvl] * 8 * 3 / 10;
+}
+
+// Bytes of arena encode_in_arena() needs: the qr code being built,
+// the mask candidate, the data codewords, the final message and the
+// character modes for MODE_AUTO
+// (plus the worst case padding to align the first matrix)
+static size_t arena_requirement(Version version, ErrorLevel err_lvl) {
+    const VersionInfo* info = get_version_info(version);
+    return _Alignof(QrMatrix) - 1 + 2 * sizeof(QrMatrix) + info->capacity[err_lvl] + info->total_words + max_char_cnt(version, err_lvl);
+}
+
+// Runs the whole pipeline with every buffer taken from 'arena'
+static QrMatrix* encode_in_arena(Arena* arena, const uint8_t* data, size_t size, ModeIndicator mode,
+    Version version, ErrorLevel err_lvl, MaskStrategy strategy, MaskReport* report) {
+    const VersionInfo* info = get_version_info(version);
+
+    QrMatrix* qr = (QrMatrix*)arena_alloc(arena, sizeof(QrMatrix), _Alignof(QrMatrix));
+    QrMatrix* candidate = (QrMatrix*)arena_alloc(arena, sizeof(QrMatrix), _Alignof(QrMatrix));
+    uint8_t* codewords = (uint8_t*)arena_alloc(arena, info->capacity[err_lvl], 1);
+    uint8_t* final = (uint8_t*)arena_alloc(arena, info->total_words, 1);
+    if (!qr || !candidate || !codewords || !final) {
+        printf("encode_in_arena(): Arena too small!\n");
+        return NULL;
+    }
+
+    if (mode == MODE_AUTO) {
+        if (size > max_char_cnt(version, err_lvl)) {
+            printf("encode_in_arena(): Too much data! Characters: %zu\n", size);
+            return NULL;
+        }
+
+        uint8_t* modes = (uint8_t*)arena_alloc(arena, size, 1);
+        if (!modes) {
+            printf("encode_in_arena(): Arena too small!\n");
+            return NULL;
+        }
+
+        choose_segments(data, size, version, modes);
+        if (!encode_segments_into(data, size, modes, version, err_lvl, codewords))
+            return NULL;
+    } else if (!encode_data_into(data, size, mode, version, err_lvl, codewords)) {
+        return NULL;
+    }
+    if (!get_final_message_into(codewords, info->capacity[err_lvl], version, err_lvl, final))
+        return NULL;
+    if (!create_qr_into(version, err_lvl, strategy, final, info->total_words, qr, candidate, report))
+        return NULL;
+
+    return qr;
+}
+
+Version qr_min_version(const uint8_t* data, size_t size, ModeIndicator mode, ErrorLevel err_lvl) {
+    if (!is_valid(1, err_lvl)) {
+        printf("qr_min_version(): Invalid error level: %d\n", err_lvl);
+        return VERSION_AUTO;
+    }
+
+    return choose_version(data, size, mode, err_lvl);
+}
+
+QrBuffers qr_buffer_requirements(Version version, ErrorLevel err_lvl) {
+    QrBuffers buffers = { 0 };
+    if (!is_valid(version, err_lvl))
+        return buffers;
+
+    const VersionInfo* info = get_version_info(version);
+    buffers.side = info->side;
+    buffers.row_words = (info->side + 63) / 64;
+    buffers.modules_size = (size_t)buffers.side * buffers.row_words * sizeof(uint64_t);
+    buffers.scratch_size = arena_requirement(version, err_lvl);
+
+    return buffers;
+}
+
+bool qr_encode_into(const uint8_t* data, size_t size, ModeIndicator mode, Version version, ErrorLevel err_lvl,
+    MaskStrategy strategy, void* scratch, size_t scratch_size, uint64_t* modules, size_t modules_size, MaskReport* report) {
+    if (!is_valid(version, err_lvl)) {
+        printf("qr_encode_into(): Invalid version or error level: %u %d\n", version, err_lvl);
+        return false;
+    }
+
+    const QrBuffers buffers = qr_buffer_requirements(version, err_lvl);
+    if (scratch_size < buffers.scratch_size || modules_size < buffers.modules_size) {
+        printf("qr_encode_into(): Buffers too small! Scratch: %zu (needs %zu) Modules: %zu (needs %zu)\n",
+            scratch_size, buffers.scratch_size, modules_size, buffers.modules_size);
+        return false;
+    }
+
+    Arena arena;
+    arena_init(&arena, scratch, scratch_size);
+
+    QrMatrix* qr = encode_in_arena(&arena, data, size, mode, version, err_lvl, strategy, report);
+    if (!qr)
+        return false;
+
+    memcpy(modules, qr->modules, buffers.modules_size);
+
+    return true;
+}
+
+// The immutable tables (Galois field, generator polynomials, templates,
+// placement tables and mask planes) are shared by every encoder, so an
+// encoder only owns the memory for the symbol it is working on
+struct QrEncoder {
+    QrOptions options;
+    Arena arena;
+};
+
+QrEncoder* qr_create_encoder(QrOptions options) {
+    if (!is_valid(1, options.err_lvl) || options.strategy > MASK_BOUNDED) {
+        printf("qr_create_encoder(): Invalid options: %d %d\n", options.err_lvl, options.strategy);
+        return NULL;
+    }
+
+    // Big enough for any symbol
+    size_t arena_size = 0;
+    for (ErrorLevel lvl = ERROR_LEVEL_LOW; lvl <= ERROR_LEVEL_HIGH; ++lvl) {
+        size_t lvl_size = arena_requirement(40, lvl);
+        if (lvl_size > arena_size)
+            arena_size = lvl_size;
+    }
+
+    QrEncoder* encoder = (QrEncoder*)malloc(sizeof(QrEncoder) + arena_size);
+    if (!encoder) {
+        printf("qr_create_encoder(): Out of memory!\n");
+        return NULL;
+    }
+
+    encoder->options = options;
+    arena_init(&encoder->arena, encoder + 1, arena_size);
+
+    return encoder;
+}
+
+void qr_delete_encoder(QrEncoder* encoder) {
+    free(encoder);
+}
+
+bool qr_encode(QrEncoder* encoder, const uint8_t* data, size_t size, ModeIndicator mode, Version version, QrCode* code) {
+    if (version == VERSION_AUTO) {
+        version = choose_version(data, size, mode, encoder->options.err_lvl);
+        if (version == VERSION_AUTO) {
+            printf("qr_encode(): Too much data for any version! Size: %zu\n", size);
+            return false;
+        }
+    }
+
+    if (!is_valid(version, encoder->options.err_lvl)) {
+        printf("qr_encode(): Invalid version: %u\n", version);
+        return false;
+    }
+
+    // Everything from the last symbol goes at once
+    arena_reset(&encoder->arena);
+
+    QrMatrix* qr = encode_in_arena(&encoder->arena, data, size, mode, version,
+        encoder->options.err_lvl, encoder->options.strategy, &code->report);
+    if (!qr)
+        return false;
+
+    code->version = version;
+    code->modules = qr->modules;
+    code->side = qr->side;
+    code->row_words = qr->row_words;
+
+    return true;
+}
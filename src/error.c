@@ -4,6 +4,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "error.h"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 /* Print bytes in binary */
 void print_bits(uint8_t* data, size_t size) {
     for (size_t i = 0; i < size; i++) {
@@ -18,38 +24,25 @@ void print_bits(uint8_t* data, size_t size) {
     putchar('\n');
 }
 
-// raises 2^x in GF(2^8)
-// ex. converts 191 to 0b01000001
-uint8_t ff_exp[255];
-
-// retrieves exponent of field element
-// ex. converts 0b01000001 to 191
-uint8_t ff_log[255];
-
-void init_finite_field() {
-    // p(x) = x^8 + x^4 + x^3 + x^2 + 1
-
-    memset(ff_log, 0, sizeof(ff_log));
-    memset(ff_exp, 0, sizeof(ff_exp));
-
-    uint8_t a8 = 0b00011101; // a^4 + a^3 + a^2 + 1
-    uint8_t a  = 0b00000001; // 1
-
-    for (int i = 0; i < 255; ++i) {
-        ff_log[a] = i;
-        ff_exp[i] = a;
-        bool is_degree_7 = a & (1 << 7);
-        a <<= 1;
-        if (is_degree_7)
-            a ^= a8;
-    }
-}
+// Galois field and generator polynomial tables, generated
+// at build time by tools/gen_tables.c (see there for the layout)
+// ff_exp: raises 2^x in GF(2^8), ex. converts 191 to 0b01000001
+// ff_log: retrieves exponent of field element, ex. converts 0b01000001 to 191
+// gen_coefficients: the generator polynomials up to degree 68, as exponents
+// gen_tables: product tables for the shift register encoder
+// gen_table_slots: maps an error codeword count to its slot in gen_tables, or -1
+// gf_nibble_tables: per-constant nibble products for the vectorized multiply
+#include "gf_tables.h"
 
 uint8_t ff_multiply(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0)
+        return 0;
+
     return ff_exp[(ff_log[a] + ff_log[b]) % 255];
 }
 
-#define MAX_DEGREE 100
+// Big enough for the largest block (123 data + 30 error codewords)
+#define MAX_DEGREE 160
 
 // a: the message polynomial (dividend), as integer values
 // b: the generator polynomial (divisor), as exponent values
@@ -57,7 +50,9 @@ uint8_t ff_multiply(uint8_t a, uint8_t b) {
 // b_deg: the degree of polynomial b
 // a_shift: multiply the polynomial 'a' by x^a_shift
 // Returns the coefficents of the remainder into rem
-void poly_div(uint8_t* a, uint8_t* b, size_t a_deg, size_t b_deg, size_t a_shift, uint8_t* rem) {
+// This is the slow reference implementation, get_error_codewords()
+// uses the shift register encoder below
+void poly_div(const uint8_t* a, const uint8_t* b, size_t a_deg, size_t b_deg, size_t a_shift, uint8_t* rem) {
     uint8_t buff[MAX_DEGREE] = { 0 };
 
     if (a_deg + 1 + a_shift > MAX_DEGREE) {
@@ -76,10 +71,10 @@ void poly_div(uint8_t* a, uint8_t* b, size_t a_deg, size_t b_deg, size_t a_shift
     for (; i < a_deg - b_deg + 1; ++i) {
         // Multiply the divisor by the
         // leading coefficient of the dividend
-        for (size_t j = 0; j < b_deg + 1; ++j) {
-            // TODO: THIS IS A LITTLE DUBIOUS
-            // (THE EXPONENT CAN EQUAL 0 FOR AN INTEGER VALUE OF 1)
-            if (b[j] != 0)
+        // (A zero coefficient has no logarithm and
+        // leaves the dividend unchanged)
+        if (coefficient != 0) {
+            for (size_t j = 0; j < b_deg + 1; ++j)
                 buff[i + j] ^= ff_exp[(b[j] + ff_log[coefficient]) % 255];
         }
 
@@ -92,40 +87,7 @@ void poly_div(uint8_t* a, uint8_t* b, size_t a_deg, size_t b_deg, size_t a_shift
     memcpy(rem, buff + i, b_deg);
 }
 
-#define MAX_GEN_DEG 68
-static uint8_t gen_coefficients[2346] = { 0 };
-
-void init_generators() {
-    // Determines the coefficients
-    // to the generator polynomials
-    // Biggest degree is 68
-
-    // Initialize the generators with polynomial degree 1
-    // (x - a^0) = (a^0*x - a^0)
-    // gen_coefficients[0] = 0;
-    // gen_coefficients[1] = 0;
-    size_t offset = 2;
-
-    // Generate polynomials up to and including degree 68
-    for (uint32_t deg = 2; deg <= MAX_GEN_DEG; ++deg) {
-        // First coefficient is always 1 or a^0
-        gen_coefficients[offset] = 0;
-        offset++;
-
-        for (uint32_t i = 0; i < deg - 1; ++i) {
-            uint8_t a = gen_coefficients[offset + i - deg];
-            uint8_t b = gen_coefficients[offset + i - deg - 1];
-            gen_coefficients[offset + i] = ff_log[ff_exp[a] ^ ff_exp[(b + deg - 1) % 255]];
-        }
-
-        uint8_t b = gen_coefficients[offset - 2];
-        gen_coefficients[offset + deg - 1] = (b + deg - 1) % 255;
-
-        offset += deg;
-    }
-}
-
-uint8_t* get_generator(uint32_t degree) {
+const uint8_t* get_generator(uint32_t degree) {
     // Returns a pointer to the beginning of the
     // coefficients of the specified degree, length degree + 1
     if (degree > MAX_GEN_DEG) {
@@ -139,9 +101,237 @@ uint8_t* get_generator(uint32_t degree) {
     return &gen_coefficients[offset];
 }
 
+typedef const uint64_t (*GenTable)[RS_WORDS];
+
+// Shift register encoder, one 64-bit word at a time
+// table: the product table of the generator polynomial
+// Feeds 'msg' into the remainder 'rem'
+void rs_update_scalar(GenTable table, uint64_t* rem, const uint8_t* msg, size_t msg_len) {
+    // The remainder, with the highest degree term in the lowest byte
+    uint64_t r0 = rem[0], r1 = rem[1], r2 = rem[2], r3 = rem[3];
+
+    for (size_t i = 0; i < msg_len; ++i) {
+        // The term that falls off the top of the register
+        // decides which multiple of the generator to add
+        uint8_t feedback = (uint8_t)r0 ^ msg[i];
+        const uint64_t* row = table[feedback];
+
+        r0 = ((r0 >> 8) | (r1 << 56)) ^ row[0];
+        r1 = ((r1 >> 8) | (r2 << 56)) ^ row[1];
+        r2 = ((r2 >> 8) | (r3 << 56)) ^ row[2];
+        r3 = (r3 >> 8) ^ row[3];
+    }
+
+    rem[0] = r0;
+    rem[1] = r1;
+    rem[2] = r2;
+    rem[3] = r3;
+}
+
+// Writes codeword j of the remainder to dst[j * stride]
+void rs_write_remainder(const uint64_t* rem, uint8_t* dst, size_t stride, uint32_t codeword_cnt) {
+    for (uint32_t j = 0; j < codeword_cnt; ++j)
+        dst[j * stride] = rem[j / 8] >> (8 * (j % 8));
+}
+
+// Codeword j is written to dst[j * stride]
+void rs_encode_scalar(GenTable table, const uint8_t* msg, size_t msg_len, uint8_t* dst, size_t stride, uint32_t codeword_cnt) {
+    uint64_t rem[RS_WORDS] = { 0 };
+    rs_update_scalar(table, rem, msg, msg_len);
+    rs_write_remainder(rem, dst, stride, codeword_cnt);
+}
+
+#ifdef __SSE2__
+// Shift register encoder with the whole remainder in two SSE registers
+// Every step multiplies all generator terms by the feedback
+// and accumulates them into the remainder with two loads and two xors
+void rs_update_sse2(GenTable table, uint64_t* rem, const uint8_t* msg, size_t msg_len) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)rem);     // Terms 0-15
+    __m128i hi = _mm_loadu_si128((const __m128i*)rem + 1); // Terms 16-31
+
+    for (size_t i = 0; i < msg_len; ++i) {
+        uint8_t feedback = (uint8_t)_mm_cvtsi128_si32(lo) ^ msg[i];
+        const __m128i* row = (const __m128i*)table[feedback];
+
+        // Shift the whole register down by one term
+        lo = _mm_or_si128(_mm_srli_si128(lo, 1), _mm_slli_si128(hi, 15));
+        hi = _mm_srli_si128(hi, 1);
+
+        lo = _mm_xor_si128(lo, _mm_loadu_si128(row));
+        hi = _mm_xor_si128(hi, _mm_loadu_si128(row + 1));
+    }
+
+    _mm_storeu_si128((__m128i*)rem, lo);
+    _mm_storeu_si128((__m128i*)rem + 1, hi);
+}
+
+void rs_encode_sse2(GenTable table, const uint8_t* msg, size_t msg_len, uint8_t* dst, size_t stride, uint32_t codeword_cnt) {
+    uint64_t rem[RS_WORDS] = { 0 };
+    rs_update_sse2(table, rem, msg, msg_len);
+    rs_write_remainder(rem, dst, stride, codeword_cnt);
+}
+#endif
+
 // Returns the error correction codewords
 // of length 'gen_deg' for an array of message codewords
+// Codeword j is written to dst[j * stride], so that the
+// codewords of a block can go straight to their interleaved positions
+void get_error_codewords_strided(const uint8_t* msg, size_t msg_len, uint8_t* dst, size_t stride, uint32_t codeword_cnt) {
+    if (codeword_cnt > MAX_EC_WORDS || gen_table_slots[codeword_cnt] < 0) {
+        printf("get_error_codewords(): Unsupported codeword count: %u\n", codeword_cnt);
+        return;
+    }
+
+    GenTable table = gen_tables[gen_table_slots[codeword_cnt]];
+
+#ifdef __SSE2__
+    rs_encode_sse2(table, msg, msg_len, dst, stride, codeword_cnt);
+#else
+    rs_encode_scalar(table, msg, msg_len, dst, stride, codeword_cnt);
+#endif
+}
+
 void get_error_codewords(uint8_t* msg, size_t msg_len, uint8_t* dst, uint32_t codeword_cnt) {
-    uint32_t msg_deg = msg_len - 1;
-    poly_div(msg, get_generator(codeword_cnt), msg_deg, codeword_cnt, codeword_cnt, dst);
+    get_error_codewords_strided(msg, msg_len, dst, 1, codeword_cnt);
+}
+
+bool rs_state_init(RsState* state, uint32_t codeword_cnt) {
+    if (codeword_cnt > MAX_EC_WORDS || gen_table_slots[codeword_cnt] < 0) {
+        printf("rs_state_init(): Unsupported codeword count: %u\n", codeword_cnt);
+        return false;
+    }
+
+    memset(state->rem, 0, sizeof(state->rem));
+    state->codeword_cnt = codeword_cnt;
+    return true;
+}
+
+void rs_state_update(RsState* state, const uint8_t* msg, size_t msg_len) {
+    GenTable table = gen_tables[gen_table_slots[state->codeword_cnt]];
+
+#ifdef __SSE2__
+    rs_update_sse2(table, state->rem, msg, msg_len);
+#else
+    rs_update_scalar(table, state->rem, msg, msg_len);
+#endif
+}
+
+void rs_state_finish(const RsState* state, uint8_t* dst, size_t stride) {
+    rs_write_remainder(state->rem, dst, stride, state->codeword_cnt);
+}
+
+// Batch shift register encoder, scalar fallback
+// Runs the single message encoder on every lane in turn
+void rs_encode_batch_scalar(GenTable table, const uint8_t* msg_soa, size_t msg_len, uint8_t* ec_soa, uint32_t codeword_cnt) {
+    uint8_t msg[MAX_DEGREE];
+
+    for (uint32_t lane = 0; lane < RS_BATCH; ++lane) {
+        for (size_t i = 0; i < msg_len; ++i)
+            msg[i] = msg_soa[i * RS_BATCH + lane];
+
+        rs_encode_scalar(table, msg, msg_len, ec_soa + lane, RS_BATCH, codeword_cnt);
+    }
+}
+
+#ifdef __SSE2__
+// Batch shift register encoder, 16 lanes per SSSE3 register
+// Every generator term is multiplied by the feedback of all
+// lanes at once with the pshufb nibble multiply
+__attribute__((target("ssse3")))
+void rs_encode_batch_ssse3(const uint8_t* gen, const uint8_t* msg_soa, size_t msg_len, uint8_t* ec_soa, uint32_t codeword_cnt) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    for (uint32_t half = 0; half < RS_BATCH; half += 16) {
+        // One register per remainder term, plus a zero at the end
+        __m128i rem[MAX_EC_WORDS + 1];
+        for (uint32_t j = 0; j <= codeword_cnt; ++j)
+            rem[j] = _mm_setzero_si128();
+
+        for (size_t i = 0; i < msg_len; ++i) {
+            __m128i feedback = _mm_xor_si128(rem[0], _mm_loadu_si128((const __m128i*)(msg_soa + i * RS_BATCH + half)));
+            __m128i lo = _mm_and_si128(feedback, nibble);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(feedback, 4), nibble);
+
+            for (uint32_t j = 0; j < codeword_cnt; ++j) {
+                const __m128i* tables = (const __m128i*)gf_nibble_tables[ff_exp[gen[j]]];
+                __m128i product = _mm_xor_si128(
+                    _mm_shuffle_epi8(_mm_load_si128(tables), lo),
+                    _mm_shuffle_epi8(_mm_load_si128(tables + 1), hi));
+                rem[j] = _mm_xor_si128(rem[j + 1], product);
+            }
+        }
+
+        for (uint32_t j = 0; j < codeword_cnt; ++j)
+            _mm_storeu_si128((__m128i*)(ec_soa + j * RS_BATCH + half), rem[j]);
+    }
+}
+
+// Batch shift register encoder, all 32 lanes in one AVX2 register
+__attribute__((target("avx2")))
+void rs_encode_batch_avx2(const uint8_t* gen, const uint8_t* msg_soa, size_t msg_len, uint8_t* ec_soa, uint32_t codeword_cnt) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    // The nibble tables of every generator term, in both 128-bit lanes
+    __m256i tables_lo[MAX_EC_WORDS];
+    __m256i tables_hi[MAX_EC_WORDS];
+    for (uint32_t j = 0; j < codeword_cnt; ++j) {
+        const __m128i* tables = (const __m128i*)gf_nibble_tables[ff_exp[gen[j]]];
+        tables_lo[j] = _mm256_broadcastsi128_si256(_mm_load_si128(tables));
+        tables_hi[j] = _mm256_broadcastsi128_si256(_mm_load_si128(tables + 1));
+    }
+
+    __m256i rem[MAX_EC_WORDS + 1];
+    for (uint32_t j = 0; j <= codeword_cnt; ++j)
+        rem[j] = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < msg_len; ++i) {
+        __m256i feedback = _mm256_xor_si256(rem[0], _mm256_loadu_si256((const __m256i*)(msg_soa + i * RS_BATCH)));
+        __m256i lo = _mm256_and_si256(feedback, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(feedback, 4), nibble);
+
+        for (uint32_t j = 0; j < codeword_cnt; ++j) {
+            __m256i product = _mm256_xor_si256(
+                _mm256_shuffle_epi8(tables_lo[j], lo),
+                _mm256_shuffle_epi8(tables_hi[j], hi));
+            rem[j] = _mm256_xor_si256(rem[j + 1], product);
+        }
+    }
+
+    for (uint32_t j = 0; j < codeword_cnt; ++j)
+        _mm256_storeu_si256((__m256i*)(ec_soa + j * RS_BATCH), rem[j]);
+}
+#endif
+
+// Computes the error correction codewords of RS_BATCH messages
+// of the same length at once
+// The messages are interleaved: byte i of message 'lane'
+// is msg_soa[i * RS_BATCH + lane], and codeword j of message
+// 'lane' is written to ec_soa[j * RS_BATCH + lane]
+void get_error_codewords_batch(const uint8_t* msg_soa, size_t msg_len, uint8_t* ec_soa, uint32_t codeword_cnt) {
+    if (codeword_cnt > MAX_EC_WORDS || gen_table_slots[codeword_cnt] < 0) {
+        printf("get_error_codewords_batch(): Unsupported codeword count: %u\n", codeword_cnt);
+        return;
+    }
+
+    if (msg_len > MAX_DEGREE) {
+        printf("get_error_codewords_batch(): Message too long: %zu\n", msg_len);
+        return;
+    }
+
+#ifdef __SSE2__
+    // Skip the leading coefficient, it is always 1
+    const uint8_t* gen = get_generator(codeword_cnt) + 1;
+
+    if (__builtin_cpu_supports("avx2")) {
+        rs_encode_batch_avx2(gen, msg_soa, msg_len, ec_soa, codeword_cnt);
+        return;
+    }
+
+    if (__builtin_cpu_supports("ssse3")) {
+        rs_encode_batch_ssse3(gen, msg_soa, msg_len, ec_soa, codeword_cnt);
+        return;
+    }
+#endif
+
+    rs_encode_batch_scalar(gen_tables[gen_table_slots[codeword_cnt]], msg_soa, msg_len, ec_soa, codeword_cnt);
 }
@@ -2,13 +2,55 @@
 #define __ERROR_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
-void init_finite_field();
-void init_generators();
+// The Galois field and generator tables are constant data
+// generated at build time, no initialization is needed
 
 // Given message 'msg' and length 'msg_len',
 // computes 'codeword_cnt' number of error
 // correction codewords into 'dst'
 void get_error_codewords(uint8_t* msg, size_t msg_len, uint8_t* dst, uint32_t codeword_cnt);
 
+// Same as get_error_codewords(), but codeword j
+// is written to dst[j * stride]
+void get_error_codewords_strided(const uint8_t* msg, size_t msg_len, uint8_t* dst, size_t stride, uint32_t codeword_cnt);
+
+// Maximum number of error correction codewords per block
+#define MAX_EC_WORDS 30
+
+// The remainder of the shift register encoder lives in
+// 4 64-bit words: byte j is (word j / 8, bits 8 * (j % 8))
+#define RS_WORDS 4
+
+// The state of the shift register encoder, so that a message
+// can be encoded in pieces. Since the encoder is a shift register,
+// the state after a common prefix can be saved and resumed for
+// every message that starts with it
+typedef struct {
+    uint64_t rem[RS_WORDS];
+    uint32_t codeword_cnt;
+} RsState;
+
+// Starts encoding a message with 'codeword_cnt' error correction codewords
+bool rs_state_init(RsState* state, uint32_t codeword_cnt);
+
+// Feeds the next 'msg_len' message codewords into the encoder
+void rs_state_update(RsState* state, const uint8_t* msg, size_t msg_len);
+
+// Writes the error correction codewords of everything fed so far,
+// codeword j goes to dst[j * stride]
+void rs_state_finish(const RsState* state, uint8_t* dst, size_t stride);
+
+// Number of messages get_error_codewords_batch() works on at once
+#define RS_BATCH 32
+
+// Computes the error correction codewords of RS_BATCH messages
+// of the same length at once
+// The messages are interleaved: byte i of message 'lane'
+// is msg_soa[i * RS_BATCH + lane], and codeword j of message
+// 'lane' is written to ec_soa[j * RS_BATCH + lane]
+void get_error_codewords_batch(const uint8_t* msg_soa, size_t msg_len, uint8_t* ec_soa, uint32_t codeword_cnt);
+
 #endif
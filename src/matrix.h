@@ -0,0 +1,105 @@
+#ifndef __MATRIX_H__
+#define __MATRIX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "qr.h"
+#include "version.h"
+
+// Side length of the biggest qr code (version 40)
+#define MAX_SIDE 177
+// 64-bit words per row of the biggest qr code
+#define MAX_ROW_WORDS 3
+
+// A bit-packed module matrix
+// Row y starts at word y * row_words, and module x of the
+// row is bit (x % 64) of word (x / 64). Bits past the side are 0
+// modules:  1 = black module, 0 = white module
+// reserved: 1 = function pattern, format or version information
+//           (modules that are not for data)
+typedef struct {
+    uint32_t side;
+    uint32_t row_words;
+    uint64_t modules[MAX_SIDE * MAX_ROW_WORDS];
+    uint64_t reserved[MAX_SIDE * MAX_ROW_WORDS];
+} QrMatrix;
+
+// Clears the matrix for a qr code of version 'ver'
+static inline void init_matrix(QrMatrix* m, Version ver) {
+    m->side = get_version_info(ver)->side;
+    m->row_words = (m->side + 63) / 64;
+    memset(m->modules, 0, m->side * m->row_words * sizeof(uint64_t));
+    memset(m->reserved, 0, m->side * m->row_words * sizeof(uint64_t));
+}
+
+static inline bool get_module(const QrMatrix* m, uint32_t x, uint32_t y) {
+    return m->modules[y * m->row_words + x / 64] >> (x % 64) & 1;
+}
+
+static inline void set_module(QrMatrix* m, uint32_t x, uint32_t y, bool black) {
+    uint64_t* word = &m->modules[y * m->row_words + x / 64];
+    uint64_t bit = (uint64_t)1 << (x % 64);
+    *word = black ? *word | bit : *word & ~bit;
+}
+
+static inline void flip_module(QrMatrix* m, uint32_t x, uint32_t y) {
+    m->modules[y * m->row_words + x / 64] ^= (uint64_t)1 << (x % 64);
+}
+
+static inline bool is_reserved(const QrMatrix* m, uint32_t x, uint32_t y) {
+    return m->reserved[y * m->row_words + x / 64] >> (x % 64) & 1;
+}
+
+// Writes a module that is not for data
+static inline void set_function_module(QrMatrix* m, uint32_t x, uint32_t y, bool black) {
+    set_module(m, x, y, black);
+    m->reserved[y * m->row_words + x / 64] |= (uint64_t)1 << (x % 64);
+}
+
+// Two-column strips of the biggest qr code
+#define MAX_STRIPS 88
+// 64-bit words per strip of the biggest qr code
+#define MAX_STRIP_WORDS 6
+
+// A bit-packed module matrix in placement order
+// Strip s covers the two columns ending at strip_right(side, s), and
+// starts at word s * strip_words. Step k of a strip is bit (k % 64)
+// of word (k / 64): row k / 2 counted from where the strip starts (the
+// bottom for upward strips), right module for even k, left for odd k
+// So consecutive data modules are neighbouring bits, with only the
+// reserved modules in between. The vertical timing pattern is in no strip
+typedef struct {
+    uint32_t side;
+    uint32_t strip_cnt;
+    uint32_t strip_words;
+    uint64_t modules[MAX_STRIPS * MAX_STRIP_WORDS];
+} StripMatrix;
+
+static inline void init_strip_matrix(StripMatrix* m, Version ver) {
+    m->side = get_version_info(ver)->side;
+    m->strip_cnt = (m->side - 1) / 2;
+    m->strip_words = (2 * m->side + 63) / 64;
+    memset(m->modules, 0, m->strip_cnt * m->strip_words * sizeof(uint64_t));
+}
+
+// The right column of strip 's', counting strips from the right
+static inline uint32_t strip_right(uint32_t side, uint32_t s) {
+    uint32_t right = side - 1 - 2 * s;
+    // Strips left of the timing pattern start one column over
+    return right <= 6 ? right - 1 : right;
+}
+
+// Strips alternate upwards and downwards, starting upwards
+static inline bool strip_is_up(uint32_t s) {
+    return s % 2 == 0;
+}
+
+// The module at step 'k' of strip 's'
+static inline void strip_step_pos(uint32_t side, uint32_t s, uint32_t k, uint32_t* x, uint32_t* y) {
+    *x = strip_right(side, s) - k % 2;
+    *y = strip_is_up(s) ? side - 1 - k / 2 : k / 2;
+}
+
+#endif
@@ -3,82 +3,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../lib/stb_image_write.h"
 
 #include "qr.h"
 #include "error.h"
+#include "matrix.h"
+#include "version.h"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 // Notes:
-// side_length = (version - 1) * 4 + 21
+// side_length = (version - 1) * 4 + 21 (see version.h)
 // Dark pixel is always at ((4 * version) + 9, 8)
 // 0 -> white pixel
 // 1 -> black pixel
-
-// Table taken from https://www.thonky.com/qr-code-tutorial/alignment-pattern-locations
-// First column is the qr code version
-// Stide: 7 bytes
-uint8_t align_pat_coords[] = {
-    6, 18, 0,  0,  0, 0, 0, // Version 2
-    6, 22, 0,  0,  0, 0, 0, // Version 3
-    6, 26, 0,  0,  0, 0, 0, // etc.
-    6, 30, 0,  0,  0, 0, 0,
-    6, 34, 0,  0,  0, 0, 0,
-    6, 22, 38, 0,  0, 0, 0,
-    6, 24, 42, 0,  0, 0, 0,
-    6, 26, 46, 0,  0, 0, 0,
-    6, 28, 50, 0,  0, 0, 0,
-    6, 30, 54, 0,  0, 0, 0,
-    6, 32, 58, 0,  0, 0, 0,
-    6, 34, 62, 0,  0, 0, 0,
-    6, 26, 46, 66, 0, 0, 0,
-    6, 26, 48, 70, 0, 0, 0,
-    6, 26, 50, 74, 0, 0, 0,
-    6, 30, 54, 78, 0, 0, 0,
-    6, 30, 56, 82, 0, 0, 0,
-    6, 30, 58, 86, 0, 0, 0,
-    6, 34, 62, 90, 0, 0, 0,
-    6, 28, 50, 72, 94, 0, 0,
-    6, 26, 50, 74, 98, 0, 0,
-    6, 30, 54, 78, 102, 0, 0,
-    6, 28, 54, 80, 106, 0, 0,
-    6, 32, 58, 84, 110, 0, 0,
-    6, 30, 58, 86, 114, 0, 0,
-    6, 34, 62, 90, 118, 0, 0,
-    6, 26, 50, 74, 98,  122, 0,
-    6, 30, 54, 78, 102, 126, 0,
-    6, 26, 52, 78, 104, 130, 0,
-    6, 30, 56, 82, 108, 134, 0,
-    6, 34, 60, 86, 112, 138, 0,
-    6, 30, 58, 86, 114, 142, 0,
-    6, 34, 62, 90, 118, 146, 0,
-    6, 30, 54, 78, 102, 126, 150,
-    6, 24, 50, 76, 102, 128, 154,
-    6, 28, 54, 80, 106, 132, 158,
-    6, 32, 58, 84, 110, 136, 162,
-    6, 26, 54, 82, 110, 138, 166,
-    6, 30, 58, 86, 114, 142, 170,
-};
-
-// Returns the number of row-column coordinates from
-// the alignment pattern table for a given qr version
-uint32_t align_pat_side_coords(Version ver) {
-    if (ver == 1) return 0;
-    if (ver < 7)  return 2;
-    if (ver < 14) return 3;
-    if (ver < 21) return 4;
-    if (ver < 28) return 5;
-    if (ver < 35) return 6;
-    return 7;
-}
+// The qr code is stored as a bit-packed QrMatrix (see matrix.h)
 
 // Checks if an alignment pattern should be placed on the
 // qr code given the coordinates of its centre module
 // (Alignment patterns must not overlap with finder patterns or separators)
 bool is_align_pat(Version ver, uint8_t x, uint8_t y) {
     // Side length of the code
-    uint32_t side = (ver - 1) * 4 + 21;
+    uint32_t side = get_version_info(ver)->side;
 
     // Too far away from any, early out
     if (x > 10 && y > 10)
@@ -99,18 +50,15 @@ bool is_align_pat(Version ver, uint8_t x, uint8_t y) {
     return true;
 }
 
-void write_square(uint8_t* canvas, size_t canvas_size, const uint8_t* square, size_t square_size, uint32_t x, uint32_t y) {
-    if (y * canvas_size + x + square_size * square_size > canvas_size * canvas_size) {
+void write_square(QrMatrix* qr, const uint8_t* square, size_t square_size, uint32_t x, uint32_t y) {
+    if (x + square_size > qr->side || y + square_size > qr->side) {
         printf("write_square(): out of bounds!\n");
         return;
     }
 
     for (uint32_t row = 0; row < square_size; ++row) {
-    	for (uint32_t col = 0; col < square_size; ++col) {
-            size_t canvas_coord = (y + row) * canvas_size + (x + col);
-            size_t square_coord = row * square_size + col;
-            canvas[canvas_coord] = square[square_coord];
-        }
+        for (uint32_t col = 0; col < square_size; ++col)
+            set_function_module(qr, x + col, y + row, square[row * square_size + col]);
     }
 }
 
@@ -123,7 +71,7 @@ bool mask1(size_t x, size_t y) { return (x + y) % 2 == 0; }
 bool mask2(size_t x, size_t y) { return y % 2 == 0; }
 bool mask3(size_t x, size_t y) { return x % 3 == 0; }
 bool mask4(size_t x, size_t y) { return (x + y) % 3 == 0; }
-bool mask5(size_t x, size_t y) { return ((y / 2) + (x + 3)) % 2 == 0; }
+bool mask5(size_t x, size_t y) { return ((y / 2) + (x / 3)) % 2 == 0; }
 bool mask6(size_t x, size_t y) { return (x * y) % 2 + (x * y) % 3 == 0; }
 bool mask7(size_t x, size_t y) { return ((x * y) % 2 + (x * y) % 3) % 2 == 0; }
 bool mask8(size_t x, size_t y) { return ((x + y) % 2 + (x * y) % 3) % 2 == 0; }
@@ -139,7 +87,9 @@ const static MaskFn mask_pats[8] = {
 // The following 2 data tables are from
 // https://www.thonky.com/qr-code-tutorial/format-version-tables
 
-void write_function_patterns(Version ver, uint8_t* qr, size_t side) {
+void write_function_patterns(Version ver, QrMatrix* qr) {
+    const uint32_t side = qr->side;
+
     // Finder pattern
     const static uint8_t finder_pat[] = {
         1, 1, 1, 1, 1, 1, 1,
@@ -161,48 +111,49 @@ void write_function_patterns(Version ver, uint8_t* qr, size_t side) {
     };
 
     // Write finder patterns
-    write_square(qr, side, finder_pat, 7, 0, 0);
-    write_square(qr, side, finder_pat, 7, side - 7, 0);
-    write_square(qr, side, finder_pat, 7, 0, side - 7);
+    write_square(qr, finder_pat, 7, 0, 0);
+    write_square(qr, finder_pat, 7, side - 7, 0);
+    write_square(qr, finder_pat, 7, 0, side - 7);
 
     // White border around the finder patterns
-    // Horizontally
-    memset(qr + side * 7, 0, 8);          // top left
-    memset(qr + side * 8 - 8, 0, 8);      // top right
-    memset(qr + side * (side - 8), 0, 8); // bottom left
-    // Vertically
-    size_t bottom_start = (side - 7) * side + 7;
+    for (uint32_t i = 0; i < 8; ++i) {
+        // Horizontally
+        set_function_module(qr, i, 7, 0);            // top left
+        set_function_module(qr, side - 8 + i, 7, 0); // top right
+        set_function_module(qr, i, side - 8, 0);     // bottom left
+    }
     for (uint32_t i = 0; i < 7; ++i) {
-        qr[i * side + 7] = 0;            // top left
-        qr[i * side + side - 8] = 0;     // top right
-        qr[i * side + bottom_start] = 0; // bottom left
+        // Vertically
+        set_function_module(qr, 7, i, 0);            // top left
+        set_function_module(qr, side - 8, i, 0);     // top right
+        set_function_module(qr, 7, side - 7 + i, 0); // bottom left
     }
 
     // Write the dark module
-    size_t dark_module = side * (side - 8) + 8; // The position of the dark module
-    qr[dark_module] = 1;
+    set_function_module(qr, 8, side - 8, 1);
 
     // Write alignment patterns
-    uint32_t coord_pairs = align_pat_side_coords(ver);
-    for (uint32_t a = 0; a < coord_pairs; ++a) {
-        for (uint32_t b = 0; b < coord_pairs; ++b) {
-            size_t offset = 7 * (ver - 2);
-            uint32_t x = align_pat_coords[offset + a];
-            uint32_t y = align_pat_coords[offset + b];
+    const VersionInfo* info = get_version_info(ver);
+    for (uint32_t a = 0; a < info->align_cnt; ++a) {
+        for (uint32_t b = 0; b < info->align_cnt; ++b) {
+            uint32_t x = info->align_coords[a];
+            uint32_t y = info->align_coords[b];
             if (is_align_pat(ver, x, y))
-                write_square(qr, side, align_pat, 5, x - 2, y - 2);
+                write_square(qr, align_pat, 5, x - 2, y - 2);
         }
     }
 
     // Write timing patterns
-    uint32_t start = 6 * side + 6;
     for (uint32_t i = 0; i < side - 13; ++i) {
-        qr[start + i] = 1 - (i & 1);
-        qr[start + i * side] = 1 - (i & 1);
+        set_function_module(qr, 6 + i, 6, 1 - (i & 1));
+        set_function_module(qr, 6, 6 + i, 1 - (i & 1));
     }
 }
 
-void write_format_info(Version ver, ErrorLevel lvl, uint32_t mask_pat, uint8_t* qr, size_t side) {
+void write_format_bits(uint16_t format_str, QrMatrix* qr);
+
+void write_format_info(ErrorLevel lvl, uint32_t mask_pat, QrMatrix* qr) {
+
     const static uint16_t format_strs[32] = {
         0b111011111000100, 0b111001011110011,
         0b111110110101010, 0b111100010011101,
@@ -224,357 +175,1212 @@ void write_format_info(Version ver, ErrorLevel lvl, uint32_t mask_pat, uint8_t*
 
     // Write the format string
     // uint16_t format_str = 0b110011000101111;
-    uint16_t format_str = format_strs[lvl * 8 + mask_pat];
+    write_format_bits(format_strs[lvl * 8 + mask_pat], qr);
+}
+
+// Writes the 15 bit format string twice (also reserving its modules)
+void write_format_bits(uint16_t format_str, QrMatrix* qr) {
+    const uint32_t side = qr->side;
 
     // Write the bottom-left format strip
-    size_t start = side * (side - 7) + 8;
-    for (uint32_t i = 0; i < 7; ++i) {
-        qr[start + (side * i)] = format_str >> (8 + i) & 1;
-    }
-    
+    for (uint32_t i = 0; i < 7; ++i)
+        set_function_module(qr, 8, side - 7 + i, format_str >> (8 + i) & 1);
+
     // Write the top-right format strip
-    start = side * 8 + side - 8;
-    for (uint32_t i = 0; i < 8; ++i) {
-        qr[start + i] = format_str >> (7 - i) & 1;
-    }
+    for (uint32_t i = 0; i < 8; ++i)
+        set_function_module(qr, side - 8 + i, 8, format_str >> (7 - i) & 1);
 
     // Write the top-left format strip
 
     // The three bits in the corner
     // (We do these separately since the timing
     // pattern interferes with the regular line)
-    size_t bit_7_pos = side * 8 + 8;
-    qr[bit_7_pos - 1]    = format_str >> 8 & 1;
-    qr[bit_7_pos]        = format_str >> 7 & 1;
-    qr[bit_7_pos - side] = format_str >> 6 & 1;
+    set_function_module(qr, 7, 8, format_str >> 8 & 1);
+    set_function_module(qr, 8, 8, format_str >> 7 & 1);
+    set_function_module(qr, 8, 7, format_str >> 6 & 1);
 
     // Top-left bottom row
-    start = side * 8;
-    for (uint32_t i = 0; i < 6; ++i) {
-        qr[start + i] = format_str >> (14 - i) & 1;
-    }
+    for (uint32_t i = 0; i < 6; ++i)
+        set_function_module(qr, i, 8, format_str >> (14 - i) & 1);
 
     // Top-left right column
-    start = 8;
-    for (uint32_t i = 0; i < 6; ++i) {
-        qr[start + (side * i)] = format_str >> i & 1;
-    }
-}
-
-void write_version_info(Version ver, uint8_t* qr, size_t side) {
-    const static uint32_t version_strs[34] = {
-        0b000111110010010100, 0b001000010110111100,
-        0b001001101010011001, 0b001010010011010011,
-        0b001011101111110110, 0b001100011101100010,
-        0b001101100001000111, 0b001110011000001101,
-        0b001111100100101000, 0b010000101101111000,
-        0b010001010001011101, 0b010010101000010111,
-        0b010011010100110010, 0b010100100110100110,
-        0b010101011010000011, 0b010110100011001001,
-        0b010111011111101100, 0b011000111011000100,
-        0b011001000111100001, 0b011010111110101011,
-        0b011011000010001110, 0b011100110000011010,
-        0b011101001100111111, 0b011110110101110101,
-        0b011111001001010000, 0b100000100111010101,
-        0b100001011011110000, 0b100010100010111010,
-        0b100011011110011111, 0b100100101100001011,
-        0b100101010000101110, 0b100110101001100100,
-        0b100111010101000001, 0b101000110001101001,
-    };
+    for (uint32_t i = 0; i < 6; ++i)
+        set_function_module(qr, 8, i, format_str >> i & 1);
+}
 
-    uint32_t version_str = version_strs[ver - 7];
+void write_version_info(Version ver, QrMatrix* qr) {
+    const uint32_t side = qr->side;
+
+    uint32_t version_str = get_version_info(ver)->version_str;
 
     // Top-right version block
-    uint32_t start = side - 11;
     for (uint32_t y = 0; y < 6; y++) {
         for (uint32_t x = 0; x < 3; x++) {
-            size_t pos = start + (y * side) + x;
-            uint32_t index = x * 3 + y;
-            qr[pos] = version_str >> index & 1;
+            uint32_t index = y * 3 + x;
+            set_function_module(qr, side - 11 + x, y, version_str >> index & 1);
         }
     }
 
-    // Top-right version block
-    start = side * (side - 11);
+    // Bottom-left version block
     for (uint32_t x = 0; x < 6; x++) {
         for (uint32_t y = 0; y < 3; y++) {
-            size_t pos = start + (y * side) + x;
             uint32_t index = x * 3 + y;
-            qr[pos] = version_str >> index & 1;
+            set_function_module(qr, x, side - 11 + y, version_str >> index & 1);
+        }
+    }
+}
+
+// Function patterns, version information and the reserved
+// format information modules (left white) of every version
+// Lazily built and published atomically like data_perms, then never
+// written again, so every qr code can start as a copy of one
+static _Atomic(QrMatrix*) qr_templates[40];
+
+const QrMatrix* get_qr_template(Version ver) {
+    _Atomic(QrMatrix*)* slot = &qr_templates[ver - 1];
+
+    QrMatrix* qr = atomic_load_explicit(slot, memory_order_acquire);
+    if (qr)
+        return qr;
+
+    qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+    if (!qr) {
+        printf("get_qr_template(): Out of memory!\n");
+        return NULL;
+    }
+
+    // The reserved bitmap records which modules are
+    // written by the function patterns and format info
+    init_matrix(qr, ver);
+
+    // Write the function patterns
+    write_function_patterns(ver, qr);
+
+    // Write version information (version 7+)
+    if (ver > 6)
+        write_version_info(ver, qr);
+
+    // Reserve the format information, which depends on the mask
+    write_format_bits(0, qr);
+
+    QrMatrix* expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(slot, &expected, qr, memory_order_acq_rel, memory_order_acquire)) {
+        // Another thread got there first
+        free(qr);
+        qr = expected;
+    }
+
+    return qr;
+}
+
+// Writes everything that does not depend on the data or the
+// mask by copying the template of the version
+bool write_qr_template(Version ver, QrMatrix* qr) {
+    const QrMatrix* template = get_qr_template(ver);
+    if (!template)
+        return false;
+
+    const size_t words = template->side * template->row_words;
+
+    qr->side = template->side;
+    qr->row_words = template->row_words;
+    memcpy(qr->modules, template->modules, words * sizeof(uint64_t));
+    memcpy(qr->reserved, template->reserved, words * sizeof(uint64_t));
+
+    return true;
+}
+
+// The position of a data module
+typedef struct {
+    uint8_t x;
+    uint8_t y;
+} ModulePos;
+
+// Records the positions of the data modules of a qr
+// code in placement order, stopping after 'count', and returns how many
+// were found. 'qr' must have the function patterns and format information
+// The modules are visited in two-column strips from the right,
+// alternating upwards and downwards, skipping the vertical timing pattern
+size_t walk_data_modules(const QrMatrix* qr, ModulePos* positions, size_t count) {
+    const uint32_t side = qr->side;
+    size_t idx = 0; // The index of the current data module
+
+    for (int32_t right = side - 1; right >= 1; right -= 2) {
+        // The strip left of the timing pattern starts one column over
+        if (right == 6)
+            right = 5;
+
+        bool is_up = ((right + 1) & 2) == 0;
+        for (uint32_t i = 0; i < side; ++i) {
+            uint32_t y = is_up ? side - 1 - i : i;
+            for (int32_t x = right; x > right - 2; --x) {
+                if (is_reserved(qr, x, y))
+                    continue;
+                if (idx == count)
+                    return idx;
+                positions[idx].x = x;
+                positions[idx].y = y;
+                ++idx;
+            }
         }
     }
+
+    return idx;
 }
 
-void write_data(Version ver, MaskFn mask, uint8_t* qr, size_t side, uint8_t* data, size_t size) {
-    size_t pos = side * side - 1; // The position on the qr code (start bottom-right)
-    size_t idx = 0;               // The index of the current bit in data
-    size_t stop = size * 8;       // TODO: GET STOP MODULE
-    bool is_up = true;            // Is the current snake pattern moving up or down
-    bool dir = 0;                 // 0 = move left, 1 = move diagonally up/down
-    while (idx < stop) {
-        if (qr[pos] == 2) {
-            // Write the current bit to each mask according to its mask rules
-            uint8_t byte = data[idx >> 3];
-            uint8_t bit = (byte >> ((7 - idx) & 7)) & 1;
-            size_t x = pos % side;
-            size_t y = pos / side;
-            qr[pos] = bit ^ mask(x, y);
-            ++idx;
+// The data modules of a version in placement order, including
+// the remainder modules that are left over after the message
+// 'bitmap' has the data modules set, laid out like QrMatrix modules
+// and 'strips' has them set laid out like StripMatrix modules
+typedef struct {
+    uint64_t bitmap[MAX_SIDE * MAX_ROW_WORDS];
+    uint64_t strips[MAX_STRIPS * MAX_STRIP_WORDS];
+    uint32_t count;
+    ModulePos positions[];
+} DataModules;
+
+// Lazily built placement tables, one per version
+// Published atomically like data_perms
+static _Atomic(DataModules*) data_module_tables[40];
+
+const DataModules* get_data_modules(Version ver) {
+    _Atomic(DataModules*)* slot = &data_module_tables[ver - 1];
+
+    DataModules* table = atomic_load_explicit(slot, memory_order_acquire);
+    if (table)
+        return table;
+
+    // Everything that isn't reserved in the template is for data
+    const QrMatrix* qr = get_qr_template(ver);
+    if (!qr)
+        return NULL;
+
+    const size_t max_count = qr->side * qr->side;
+    table = (DataModules*)malloc(sizeof(DataModules) + max_count * sizeof(ModulePos));
+    if (!table) {
+        printf("get_data_modules(): Out of memory!\n");
+        return NULL;
+    }
+    table->count = walk_data_modules(qr, table->positions, max_count);
+
+    // If the table can't shrink, the bigger one does just as well
+    DataModules* shrunk = (DataModules*)realloc(table, sizeof(DataModules) + table->count * sizeof(ModulePos));
+    if (shrunk)
+        table = shrunk;
+
+    memset(table->bitmap, 0, sizeof(table->bitmap));
+    for (uint32_t i = 0; i < table->count; ++i) {
+        const ModulePos pos = table->positions[i];
+        table->bitmap[pos.y * qr->row_words + pos.x / 64] |= (uint64_t)1 << (pos.x % 64);
+    }
+
+    StripMatrix strips;
+    init_strip_matrix(&strips, ver);
+    memset(table->strips, 0, sizeof(table->strips));
+    for (uint32_t s = 0; s < strips.strip_cnt; ++s) {
+        for (uint32_t k = 0; k < 2 * strips.side; ++k) {
+            uint32_t x, y;
+            strip_step_pos(strips.side, s, k, &x, &y);
+            if (!is_reserved(qr, x, y))
+                table->strips[s * strips.strip_words + k / 64] |= (uint64_t)1 << (k % 64);
         }
+    }
+
+    DataModules* expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(slot, &expected, table, memory_order_acq_rel, memory_order_acquire)) {
+        // Another thread got there first
+        free(table);
+        table = expected;
+    }
+
+    return table;
+}
+
+// The eight mask patterns as bitplanes for the biggest qr code
+// Row y of mask m starts at rows[m][y * MAX_ROW_WORDS], and since
+// a row is laid out the same for every side, smaller qr codes
+// use the top-left corner
+typedef struct {
+    uint64_t rows[8][MAX_SIDE * MAX_ROW_WORDS];
+} MaskPlanes;
+
+static _Atomic(MaskPlanes*) mask_planes;
+
+const MaskPlanes* get_mask_planes() {
+    MaskPlanes* planes = atomic_load_explicit(&mask_planes, memory_order_acquire);
+    if (planes)
+        return planes;
+
+    planes = (MaskPlanes*)malloc(sizeof(MaskPlanes));
+    if (!planes) {
+        printf("get_mask_planes(): Out of memory!\n");
+        return NULL;
+    }
+
+    for (uint32_t m = 0; m < 8; ++m) {
+        uint64_t* rows = planes->rows[m];
+        for (uint32_t y = 0; y < MAX_SIDE; ++y) {
+            uint64_t* row = &rows[y * MAX_ROW_WORDS];
+
+            // Every mask repeats every 12 rows
+            if (y >= 12) {
+                memcpy(row, row - 12 * MAX_ROW_WORDS, MAX_ROW_WORDS * sizeof(uint64_t));
+                continue;
+            }
+
+            memset(row, 0, MAX_ROW_WORDS * sizeof(uint64_t));
+            for (uint32_t x = 0; x < MAX_SIDE; ++x)
+                row[x / 64] |= (uint64_t)mask_pats[m](x, y) << (x % 64);
+        }
+    }
+
+    MaskPlanes* expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&mask_planes, &expected, planes, memory_order_acq_rel, memory_order_acquire)) {
+        // Another thread got there first
+        free(planes);
+        planes = expected;
+    }
+
+    return planes;
+}
+
+// Applies mask 'mask' to the data modules of 'qr' (applying
+// it again removes it), a word at a time
+bool apply_mask(Version ver, uint8_t mask, QrMatrix* qr) {
+    const DataModules* table = get_data_modules(ver);
+    const MaskPlanes* planes = get_mask_planes();
+    if (!table || !planes)
+        return false;
+
+    const uint64_t* plane = planes->rows[mask];
+    const uint64_t* bitmap = table->bitmap;
+    const uint32_t words = qr->row_words;
+
+    for (uint32_t y = 0; y < qr->side; ++y)
+        for (uint32_t w = 0; w < words; ++w)
+            qr->modules[y * words + w] ^= plane[y * MAX_ROW_WORDS + w] & bitmap[y * words + w];
+
+    return true;
+}
+
+// Scatters the bits of 'data' into the data modules of 'qr',
+// which must still be white (as left by init_matrix()), unmasked
+// The modules after the data are remainder bits (0)
+// This goes a module at a time through the placement table, so
+// every step lands in another row: place_data() goes through the
+// strip layout instead and gives the same result
+bool place_data_rows(Version ver, QrMatrix* qr, uint8_t* data, size_t size) {
+    const DataModules* table = get_data_modules(ver);
+    if (!table)
+        return false;
+
+    size_t stop = size * 8;
+
+    if (stop > table->count) {
+        printf("place_data_rows(): Too much data! Modules: %u Bits: %zu\n", table->count, stop);
+        stop = table->count;
+    }
 
-        if (dir) { // Move diagonally
-            // Check if top or bottom has been hit
-            bool top = pos < side;
-            bool bottom = pos > side * side - side;
+    for (size_t idx = 0; idx < stop; ++idx) {
+        const ModulePos pos = table->positions[idx];
+        uint64_t bit = (data[idx >> 3] >> (7 - (idx & 7))) & 1;
+        qr->modules[pos.y * qr->row_words + pos.x / 64] |= bit << (pos.x % 64);
+    }
+
+    return true;
+}
 
-            if (is_up) {
-                if (top) {
-                    pos -= 1;
-                    is_up = false;
+// Penalty scoring (ISO 18004 section 7.8.3)
+// N1: 3 + (length - 5) for every run of 5+ modules of one colour
+// N2: 3 for every 2x2 block of one colour
+// N3: 40 for every 1:1:3:1:1 finder-like pattern with 4 light modules
+//     on one side (1011101 0000 or 0000 1011101, inside the symbol)
+// N4: 10 for every 5% the dark modules are away from 50%
+#define PENALTY_N1 3
+#define PENALTY_N2 3
+#define PENALTY_N3 40
+#define PENALTY_N4 10
+
+// Scalar reference scorer, module by module
+uint32_t evaluate_qr_reference(const QrMatrix* qr) {
+    const uint32_t side = qr->side;
+    uint32_t penalty = 0;
+
+    // N1 and N3, rows (dir = 0) then columns (dir = 1)
+    for (uint32_t dir = 0; dir < 2; ++dir) {
+        for (uint32_t i = 0; i < side; ++i) {
+            uint32_t run = 0;
+            bool last = false;
+            for (uint32_t j = 0; j < side; ++j) {
+                bool module = dir ? get_module(qr, i, j) : get_module(qr, j, i);
+                if (j > 0 && module == last) {
+                    ++run;
                 } else {
-                    pos -= side - 1;
+                    if (run >= 5)
+                        penalty += PENALTY_N1 + run - 5;
+                    run = 1;
                 }
-            } else {
-                if (bottom) {
-                    pos -= 1;
-                    is_up = true;
-                } else {
-                    pos += side + 1;
+                last = module;
+            }
+            if (run >= 5)
+                penalty += PENALTY_N1 + run - 5;
+
+            const static uint8_t finder_like[2][11] = {
+                { 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0 },
+                { 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1 },
+            };
+            for (uint32_t j = 0; j + 11 <= side; ++j) {
+                for (uint32_t p = 0; p < 2; ++p) {
+                    uint32_t k = 0;
+                    for (; k < 11; ++k) {
+                        bool module = dir ? get_module(qr, i, j + k) : get_module(qr, j + k, i);
+                        if (module != finder_like[p][k])
+                            break;
+                    }
+                    if (k == 11)
+                        penalty += PENALTY_N3;
                 }
             }
-        } else { // Move left
-            --pos;
         }
+    }
 
-        dir = !dir;
+    // N2
+    for (uint32_t y = 0; y + 1 < side; ++y) {
+        for (uint32_t x = 0; x + 1 < side; ++x) {
+            bool module = get_module(qr, x, y);
+            if (get_module(qr, x + 1, y) == module && get_module(qr, x, y + 1) == module && get_module(qr, x + 1, y + 1) == module)
+                penalty += PENALTY_N2;
+        }
     }
 
-    // Add remainder bits
-    pos -= side - 1;
-    printf("SIDE: %zu", side);
-    printf("POSITION: X: %zu, Y: %zu\n", pos % side, pos / side);
+    // N4
+    uint32_t dark = 0;
+    for (uint32_t y = 0; y < side; ++y)
+        for (uint32_t x = 0; x < side; ++x)
+            dark += get_module(qr, x, y);
 
-    stop = side * 8;
-    while (pos > stop) {
-        size_t x = pos % side;
-        size_t y = pos / side;
-        qr[pos] = 0 ^ mask(x, y);
-        pos -= side;
-        printf("x: %zu y: %zu\n", x, y);
+    uint32_t total = side * side;
+    uint32_t diff = dark * 20 > total * 10 ? dark * 20 - total * 10 : total * 10 - dark * 20;
+    penalty += diff / total * PENALTY_N4;
+
+    return penalty;
+}
+
+// Transposes a 64x64 bit block in place: bit c of row r
+// swaps with bit r of row c (Hacker's Delight 7-3)
+static void transpose_block(uint64_t rows[64]) {
+    uint64_t m = 0x00000000FFFFFFFF;
+    for (uint32_t j = 32; j != 0; j >>= 1, m ^= m << j) {
+        for (uint32_t k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = ((rows[k] >> j) ^ rows[k | j]) & m;
+            rows[k | j] ^= t;
+            rows[k] ^= t << j;
+        }
     }
 }
 
-uint8_t* create_qr(Version ver, ErrorLevel lvl, uint8_t* data, size_t size) {
-    // Side length of the qr code
-    uint32_t side = (ver - 1) * 4 + 21;
+// Writes the columns of the side x side bit matrix 'rows'
+// as the rows of 'cols' (both 'words' words per row)
+static void transpose_words(const uint64_t* rows, uint64_t* cols, uint32_t side, uint32_t words) {
+    uint64_t block[64];
 
-    // Allocate space for 8 versions of the qr code (for masking)
-    uint8_t* masked_qrs[8];
-    for (uint32_t i = 0; i < 8; ++i)
-        masked_qrs[i] = (uint8_t*)malloc(side * side);
+    for (uint32_t by = 0; by < words; ++by) {
+        for (uint32_t bx = 0; bx < words; ++bx) {
+            for (uint32_t i = 0; i < 64; ++i) {
+                uint32_t y = by * 64 + i;
+                block[i] = y < side ? rows[y * words + bx] : 0;
+            }
 
-    // Write the functional patterns to the first one
-    // then copy them into the rest of the qr code versions
-    uint8_t* qr = masked_qrs[0];
+            transpose_block(block);
 
-    // Fill the code with 2 (unwritten) so that we can determine
-    // which modules are for data after we write the function
-    // patterns and format info (since 1s and 0s are written for function patterns)
-    memset(qr, 2, side * side);
+            for (uint32_t i = 0; i < 64; ++i) {
+                uint32_t x = bx * 64 + i;
+                if (x < side)
+                    cols[x * words + by] = block[i];
+            }
+        }
+    }
+}
 
-    // Write the function patterns
-    write_function_patterns(ver, qr, side);
+// Writes the columns of 'qr' as the rows of 'cols'
+// ('cols' uses the same row_words layout as 'qr')
+void transpose_modules(const QrMatrix* qr, uint64_t* cols) {
+    transpose_words(qr->modules, cols, qr->side, qr->row_words);
+}
 
-    // Write version information (version 7+)
-    if (ver > 6)
-        write_version_info(ver, qr, side);
+// The strip layout (see StripMatrix)
+// Data placement fills whole strip words at once: the data modules
+// of a word take the next message bits in order (a bit deposit), and
+// the strips are turned into rows once, with the bit matrix transpose
+
+// Bytes with their bits in reverse order
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+static const uint8_t reversed_bytes[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R2
+#undef R4
+#undef R6
+
+// Reads a message in placement order (most significant bit of
+// each byte first) with the next bit in bit 0 of 'bits'
+// Past the end of the message every bit is 0
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t next; // The next byte to load
+    uint64_t bits;
+    uint32_t have; // Bits loaded but not read yet
+} BitStream;
+
+// Returns the next 'n' (n <= 32) bits of 'stream'
+static inline uint64_t read_bits(BitStream* stream, uint32_t n) {
+    while (stream->have <= 56 && stream->next < stream->size) {
+        stream->bits |= (uint64_t)reversed_bytes[stream->data[stream->next++]] << stream->have;
+        stream->have += 8;
+    }
 
-    // Repeat for every mask type
-    for (uint8_t m = 0; m < 8; ++m) {
-        // Write the version and format information
-        // write_format_info(ver, lvl, m, masked_qrs[m], side);
+    uint64_t bits = stream->bits & (((uint64_t)1 << n) - 1);
+    stream->bits >>= n;
+    stream->have = stream->have > n ? stream->have - n : 0;
+    return bits;
+}
+
+// Puts the low bits of 'src' at the set bits of 'mask', in order
+static inline uint64_t deposit_bits(uint64_t src, uint64_t mask) {
+    uint64_t bits = 0;
+    for (; mask; mask &= mask - 1, src >>= 1)
+        bits |= mask & -mask & -(src & 1);
+    return bits;
+}
 
-        // Write the data modules (data and error correction codes)
-        // write_data(ver, mask_pats[m], masked_qrs[m], side, data, size);
+// Fills the words of 'strips' from 'stream', using 'deposit' for
+// the deposit (see place_data())
+#define PLACE_STRIPS(name, deposit, attr) \
+    attr static void name(const uint64_t* data_strips, StripMatrix* strips, BitStream* stream) { \
+        const uint32_t words = strips->strip_cnt * strips->strip_words; \
+        for (uint32_t i = 0; i < words; ++i) { \
+            const uint64_t mask = data_strips[i]; \
+            const uint32_t low = __builtin_popcountll(mask & 0xFFFFFFFF); \
+            uint64_t src = read_bits(stream, low); \
+            src |= read_bits(stream, __builtin_popcountll(mask >> 32)) << low; \
+            strips->modules[i] = deposit(src, mask); \
+        } \
     }
-    write_format_info(ver, lvl, 0, masked_qrs[0], side);
-    write_data(ver, mask_pats[0], qr, side, data, size);
 
-    // TODO: Evaluate the masks
-    
-    // Delete the unneeded masks
-    size_t chosen_one = 0;
-    qr = masked_qrs[chosen_one];
-    for (uint32_t i = 0; i < 8; ++i) {
-        if (i == chosen_one)
-            continue;
-        free(masked_qrs[i]);
+PLACE_STRIPS(place_strips_scalar, deposit_bits, )
+#ifdef __SSE2__
+PLACE_STRIPS(place_strips_bmi2, _pdep_u64, __attribute__((target("bmi2"))))
+#endif
+
+// Writes the bits of 'data' into the data modules of 'strips'
+// (every word is written, nothing needs clearing first)
+// The modules after the data are remainder bits (0)
+bool place_data_strips(Version ver, StripMatrix* strips, uint8_t* data, size_t size) {
+    const DataModules* table = get_data_modules(ver);
+    if (!table)
+        return false;
+
+    if (size * 8 > table->count)
+        printf("place_data_strips(): Too much data! Modules: %u Bits: %zu\n", table->count, size * 8);
+
+    BitStream stream = { data, size, 0, 0, 0 };
+
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("bmi2")) {
+        place_strips_bmi2(table->strips, strips, &stream);
+        return true;
     }
+#endif
 
-    return qr;
+    place_strips_scalar(table->strips, strips, &stream);
+
+    return true;
+}
+
+// Gathers the even bits of 'x' into the low 32 bits
+static inline uint64_t even_bits(uint64_t x) {
+    x &= 0x5555555555555555;
+    x = (x | x >> 1) & 0x3333333333333333;
+    x = (x | x >> 2) & 0x0F0F0F0F0F0F0F0F;
+    x = (x | x >> 4) & 0x00FF00FF00FF00FF;
+    x = (x | x >> 8) & 0x0000FFFF0000FFFF;
+    return (x | x >> 16) & 0x00000000FFFFFFFF;
+}
+
+static inline uint64_t reverse_bits32(uint64_t x) {
+    x = (x >> 1 & 0x55555555) | (x & 0x55555555) << 1;
+    x = (x >> 2 & 0x33333333) | (x & 0x33333333) << 2;
+    x = (x >> 4 & 0x0F0F0F0F) | (x & 0x0F0F0F0F) << 4;
+    return __builtin_bswap32(x);
+}
+
+// ORs the 32 bits of 'bits' into the bit vector 'vec' from bit
+// 'start' up, dropping the ones that would be below bit 0
+static inline void or_bits32(uint64_t* vec, int32_t start, uint64_t bits) {
+    if (start < 0) {
+        bits >>= -start;
+        start = 0;
+    }
+
+    vec[start / 64] |= bits << (start % 64);
+    if (start % 64 > 32)
+        vec[start / 64 + 1] |= bits >> (64 - start % 64);
 }
 
-void print_qr(const uint8_t* data, Version ver) {
-    uint32_t side = (ver - 1) * 4 + 21;
-    
-    for (uint32_t y = 0; y < side; ++y) {
-        for (uint32_t x = 0; x < side; ++x) {
-            if (data[y * side + x] == 0)
-                printf(" ");
-            else if (data[y * side + x] == 1)
-                printf("#");
-            else if (data[y * side + x] == 2)
-                printf(".");
+// ORs the modules of 'strips' into 'qr' (of the same version)
+// Every strip word holds 32 rows of its two columns, so the strips
+// are split into columns, which are transposed into rows
+void strips_to_rows(const StripMatrix* strips, QrMatrix* qr) {
+    const uint32_t side = qr->side;
+    const uint32_t words = qr->row_words;
+    uint64_t cols[MAX_SIDE * MAX_ROW_WORDS];
+    uint64_t rows[MAX_SIDE * MAX_ROW_WORDS];
+
+    memset(cols, 0, side * words * sizeof(uint64_t));
+    for (uint32_t s = 0; s < strips->strip_cnt; ++s) {
+        const uint64_t* strip = &strips->modules[s * strips->strip_words];
+        uint64_t* right = &cols[strip_right(side, s) * words];
+        uint64_t* left = right - words;
+
+        for (uint32_t w = 0; w < strips->strip_words; ++w) {
+            uint64_t right_bits = even_bits(strip[w]);
+            uint64_t left_bits = even_bits(strip[w] >> 1);
+
+            if (strip_is_up(s)) {
+                // Rows side - 1 - 32w downwards, so reverse them
+                int32_t start = side - 32 - 32 * w;
+                or_bits32(right, start, reverse_bits32(right_bits));
+                or_bits32(left, start, reverse_bits32(left_bits));
+            } else {
+                or_bits32(right, 32 * w, right_bits);
+                or_bits32(left, 32 * w, left_bits);
+            }
         }
+    }
 
-        printf("\n");
+    // The transpose is its own inverse
+    transpose_words(cols, rows, side, words);
+    for (uint32_t i = 0; i < side * words; ++i)
+        qr->modules[i] |= rows[i];
+}
+
+// Scatters the bits of 'data' into the data modules of 'qr',
+// which must still be white (as left by init_matrix()), unmasked
+// The modules after the data are remainder bits (0)
+bool place_data(Version ver, QrMatrix* qr, uint8_t* data, size_t size) {
+    StripMatrix strips;
+    init_strip_matrix(&strips, ver);
+    if (!place_data_strips(ver, &strips, data, size))
+        return false;
+    strips_to_rows(&strips, qr);
+
+    return true;
+}
+
+// Writes the data modules masked with mask 'mask'
+bool write_data(Version ver, uint8_t mask, QrMatrix* qr, uint8_t* data, size_t size) {
+    return place_data(ver, qr, data, size) && apply_mask(ver, mask, qr);
+}
+
+// Word 'w' of a row shifted towards module 0 by 'n' (n < 64),
+// so bit x of the result is module x + n
+static inline uint64_t row_shift(const uint64_t* row, uint32_t words, uint32_t w, uint32_t n) {
+    uint64_t next = w + 1 < words ? row[w + 1] : 0;
+    return n ? row[w] >> n | next << (64 - n) : row[w];
+}
+
+// The bits of word 'w' that are modules 0 .. 'len' - 1
+static inline uint64_t row_mask(uint32_t w, int32_t len) {
+    int32_t bits = len - (int32_t)w * 64;
+    if (bits <= 0)
+        return 0;
+    return bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+
+// N1 and N3 for one row of a bitboard
+static uint32_t evaluate_line(const uint64_t* row, uint32_t side, uint32_t words) {
+    uint32_t penalty = 0;
+
+    // eq has bit x set when module x and x + 1 match. A run of
+    // length L >= 5 has L - 4 starts of 4 matching pairs in a row,
+    // so its penalty L - 2 is those plus 2 for the run itself
+    uint64_t eq[MAX_ROW_WORDS];
+    for (uint32_t w = 0; w < words; ++w)
+        eq[w] = ~(row[w] ^ row_shift(row, words, w, 1)) & row_mask(w, side - 1);
+
+    uint64_t carry = 0;
+    for (uint32_t w = 0; w < words; ++w) {
+        uint64_t run4 = eq[w] & row_shift(eq, words, w, 1) & row_shift(eq, words, w, 2) & row_shift(eq, words, w, 3);
+        uint64_t starts = run4 & ~(run4 << 1 | carry);
+        carry = run4 >> 63;
+        penalty += __builtin_popcountll(run4) + 2 * __builtin_popcountll(starts);
     }
+
+    // Slide an 11 module window along the row, bit x of
+    // s[k] being module x + k
+    for (uint32_t w = 0; w < words; ++w) {
+        uint64_t s[11];
+        for (uint32_t k = 0; k < 11; ++k)
+            s[k] = row_shift(row, words, w, k);
+
+        // 1011101 in the middle of both patterns
+        uint64_t core = s[4] & ~s[5] & s[6] & s[7] & s[8] & ~s[9] & s[10];
+        uint64_t before = ~(s[0] | s[1] | s[2] | s[3]) & core;
+        uint64_t after = s[0] & ~s[1] & s[2] & s[3] & s[4] & ~s[5] & s[6] & ~(s[7] | s[8] | s[9] | s[10]);
+
+        uint64_t valid = row_mask(w, (int32_t)side - 10);
+        penalty += PENALTY_N3 * (__builtin_popcountll(before & valid) + __builtin_popcountll(after & valid));
+    }
+
+    return penalty;
 }
 
-// 1: Error correction codewords per block
-// 2: Number of blocks in first group
-// 3: Number of data codewords in each block
-// 4: Number of blocks in second group
-// 5: Number of data codewords in each block
-// Data taken from https://www.thonky.com/qr-code-tutorial/error-correction-table
-const uint8_t error_table[] = {
-    7, 1, 19, 0, 0, 10, 1, 16, 0, 0, 13, 1, 13, 0, 0,
-    17, 1, 9, 0, 0, 10, 1, 34, 0, 0, 16, 1, 28, 0, 0,
-    22, 1, 22, 0, 0, 28, 1, 16, 0, 0, 15, 1, 55, 0, 0,
-    26, 1, 44, 0, 0, 18, 2, 17, 0, 0, 22, 2, 13, 0, 0,
-    20, 1, 80, 0, 0, 18, 2, 32, 0, 0, 26, 2, 24, 0, 0,
-    16, 4, 9, 0, 0, 26, 1, 108, 0, 0, 24, 2, 43, 0, 0,
-    18, 2, 15, 2, 16, 22, 2, 11, 2, 12, 18, 2, 68, 0, 0,
-    16, 4, 27, 0, 0, 24, 4, 19, 0, 0, 28, 4, 15, 0, 0,
-    20, 2, 78, 0, 0, 18, 4, 31, 0, 0, 18, 2, 14, 4, 15,
-    26, 4, 13, 1, 14, 24, 2, 97, 0, 0, 22, 2, 38, 2, 39,
-    22, 4, 18, 2, 19, 26, 4, 14, 2, 15, 30, 2, 116, 0, 0,
-    22, 3, 36, 2, 37, 20, 4, 16, 4, 17, 24, 4, 12, 4, 13,
-    18, 2, 68, 2, 69, 26, 4, 43, 1, 44, 24, 6, 19, 2, 20,
-    28, 6, 15, 2, 16, 20, 4, 81, 0, 0, 30, 1, 50, 4, 51,
-    28, 4, 22, 4, 23, 24, 3, 12, 8, 13, 24, 2, 92, 2, 93,
-    22, 6, 36, 2, 37, 26, 4, 20, 6, 21, 28, 7, 14, 4, 15,
-    26, 4, 107, 0, 0, 22, 8, 37, 1, 38, 24, 8, 20, 4, 21,
-    22, 12, 11, 4, 12, 30, 3, 115, 1, 116, 24, 4, 40, 5, 41,
-    20, 11, 16, 5, 17, 24, 11, 12, 5, 13, 22, 5, 87, 1, 88,
-    24, 5, 41, 5, 42, 30, 5, 24, 7, 25, 24, 11, 12, 7, 13,
-    24, 5, 98, 1, 99, 28, 7, 45, 3, 46, 24, 15, 19, 2, 20,
-    30, 3, 15, 13, 16, 28, 1, 107, 5, 108, 28, 10, 46, 1, 47,
-    28, 1, 22, 15, 23, 28, 2, 14, 17, 15, 30, 5, 120, 1, 121,
-    26, 9, 43, 4, 44, 28, 17, 22, 1, 23, 28, 2, 14, 19, 15,
-    28, 3, 113, 4, 114, 26, 3, 44, 11, 45, 26, 17, 21, 4, 22,
-    26, 9, 13, 16, 14, 28, 3, 107, 5, 108, 26, 3, 41, 13, 42,
-    30, 15, 24, 5, 25, 28, 15, 15, 10, 16, 28, 4, 116, 4, 117,
-    26, 17, 42, 0, 0, 28, 17, 22, 6, 23, 30, 19, 16, 6, 17,
-    28, 2, 111, 7, 112, 28, 17, 46, 0, 0, 30, 7, 24, 16, 25,
-    24, 34, 13, 0, 0, 30, 4, 121, 5, 122, 28, 4, 47, 14, 48,
-    30, 11, 24, 14, 25, 30, 16, 15, 14, 16, 30, 6, 117, 4, 118,
-    28, 6, 45, 14, 46, 30, 11, 24, 16, 25, 30, 30, 16, 2, 17,
-    26, 8, 106, 4, 107, 28, 8, 47, 13, 48, 30, 7, 24, 22, 25,
-    30, 22, 15, 13, 16, 28, 10, 114, 2, 115, 28, 19, 46, 4, 47,
-    28, 28, 22, 6, 23, 30, 33, 16, 4, 17, 30, 8, 122, 4, 123,
-    28, 22, 45, 3, 46, 30, 8, 23, 26, 24, 30, 12, 15, 28, 16,
-    30, 3, 117, 10, 118, 28, 3, 45, 23, 46, 30, 4, 24, 31, 25,
-    30, 11, 15, 31, 16, 30, 7, 116, 7, 117, 28, 21, 45, 7, 46,
-    30, 1, 23, 37, 24, 30, 19, 15, 26, 16, 30, 5, 115, 10, 116,
-    28, 19, 47, 10, 48, 30, 15, 24, 25, 25, 30, 23, 15, 25, 16,
-    30, 13, 115, 3, 116, 28, 2, 46, 29, 47, 30, 42, 24, 1, 25,
-    30, 23, 15, 28, 16, 30, 17, 115, 0, 0, 28, 10, 46, 23, 47,
-    30, 10, 24, 35, 25, 30, 19, 15, 35, 16, 30, 17, 115, 1, 116,
-    28, 14, 46, 21, 47, 30, 29, 24, 19, 25, 30, 11, 15, 46, 16,
-    30, 13, 115, 6, 116, 28, 14, 46, 23, 47, 30, 44, 24, 7, 25,
-    30, 59, 16, 1, 17, 30, 12, 121, 7, 122, 28, 12, 47, 26, 48,
-    30, 39, 24, 14, 25, 30, 22, 15, 41, 16, 30, 6, 121, 14, 122,
-    28, 6, 47, 34, 48, 30, 46, 24, 10, 25, 30, 2, 15, 64, 16,
-    30, 17, 122, 4, 123, 28, 29, 46, 14, 47, 30, 49, 24, 10, 25,
-    30, 24, 15, 46, 16, 30, 4, 122, 18, 123, 28, 13, 46, 32, 47,
-    30, 48, 24, 14, 25, 30, 42, 15, 32, 16, 30, 20, 117, 4, 118,
-    28, 40, 47, 7, 48, 30, 43, 24, 22, 25, 30, 10, 15, 67, 16,
-    30, 19, 118, 6, 119, 28, 18, 47, 31, 48, 30, 34, 24, 34, 25,
-    30, 20, 15, 61, 16,
-};
+// N2 for the 2x2 blocks in rows 'r0' and 'r1': a block has matching
+// neighbours in both rows and matching modules between the rows
+static uint32_t evaluate_blocks(const uint64_t* r0, const uint64_t* r1, uint32_t side, uint32_t words) {
+    uint32_t blocks = 0;
+    for (uint32_t w = 0; w < words; ++w) {
+        uint64_t same = ~(r0[w] ^ r1[w]) & ~(r0[w] ^ row_shift(r0, words, w, 1)) & ~(r1[w] ^ row_shift(r1, words, w, 1));
+        blocks += __builtin_popcountll(same & row_mask(w, side - 1));
+    }
+    return blocks * PENALTY_N2;
+}
 
-uint8_t* get_final_message(uint8_t* msg, size_t msg_len, Version ver, ErrorLevel lvl) {
-    size_t offset = 20 * (ver - 1) + 5 * lvl;
-    // Number of error codewords for each block
-    uint8_t err_cnt = error_table[offset];
-    // Number of blocks in group 1
-    uint8_t block_cnt_1 = error_table[offset + 1];
-    // Number of data codewords in each group 1 block
-    uint8_t word_cnt_1 = error_table[offset + 2];
-    // Number of blocks in group 2
-    uint8_t block_cnt_2 = error_table[offset + 3];
-    // Number of data codewords in each group 2 block
-    uint8_t word_cnt_2 = error_table[offset + 4];
+// The number of lines (rows, columns and pairs of rows)
+// evaluate_qr_bounded() scores for a qr code
+static inline uint32_t penalty_line_count(uint32_t side) {
+    return 3 * side - 1;
+}
 
-    // Verify the length of msg
-    const size_t total_data_words = (size_t)block_cnt_1 * (size_t)word_cnt_1 + (size_t)block_cnt_2 * (size_t)word_cnt_2;
-    if (msg_len != total_data_words) {
-        printf("get_final_message(): Suspicious msg len!\n");
-        printf("Expected size: %zu, Actual size: %zu\n", total_data_words, msg_len);
-        return NULL;
+// Penalty score of a qr code, computed on the packed rows
+// and on a transposed copy for the columns
+// Scoring stops as soon as the penalty reaches 'bound', returning
+// the partial penalty. Every rule only adds to the penalty, so
+// a partial score at the bound can't beat it. N4 goes first, then
+// the rows, columns and row pairs are visited 8 apart in
+// interleaved passes, so bad patterns anywhere are found early
+// 'lines' (if not NULL) is set to the number of lines scored
+uint32_t evaluate_qr_bounded(const QrMatrix* qr, uint32_t bound, uint32_t* lines) {
+    const uint32_t side = qr->side;
+    const uint32_t words = qr->row_words;
+
+    // N4
+    uint32_t dark = 0;
+    for (uint32_t i = 0; i < side * words; ++i)
+        dark += __builtin_popcountll(qr->modules[i]);
+
+    uint32_t total = side * side;
+    uint32_t diff = dark * 20 > total * 10 ? dark * 20 - total * 10 : total * 10 - dark * 20;
+    uint32_t penalty = diff / total * PENALTY_N4;
+
+    uint64_t cols[MAX_SIDE * MAX_ROW_WORDS];
+    transpose_modules(qr, cols);
+
+    const static uint8_t pass_starts[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+    uint32_t scored = 0;
+    for (uint32_t p = 0; p < 8 && penalty < bound; ++p) {
+        for (uint32_t i = pass_starts[p]; i < side && penalty < bound; i += 8) {
+            const uint64_t* row = &qr->modules[i * words];
+            penalty += evaluate_line(row, side, words);
+            penalty += evaluate_line(&cols[i * words], side, words);
+            scored += 2;
+            if (i + 1 < side) {
+                penalty += evaluate_blocks(row, row + words, side, words);
+                ++scored;
+            }
+        }
     }
 
-    // Add one since 'error_cnt' is the degree, and
-    // the number of terms is 1 more than that
-    const size_t total_err_words = err_cnt * (block_cnt_1 + block_cnt_2);
-    uint8_t* err_words = (uint8_t*)malloc(total_err_words);
+    if (lines)
+        *lines = scored;
 
-    // Generate error correction codewords for each block
-    size_t msg_offset = 0;
-    size_t err_offset = 0;
+    return penalty;
+}
+
+uint32_t evaluate_qr(const QrMatrix* qr) {
+    return evaluate_qr_bounded(qr, UINT32_MAX, NULL);
+}
+
+// Writes the format information and the masked data
+// into a qr code made by write_qr_template()
+bool write_masked_data(Version ver, ErrorLevel lvl, uint8_t mask, QrMatrix* qr, uint8_t* data, size_t size) {
+    write_format_info(lvl, mask, qr);
+    return write_data(ver, mask, qr, data, size);
+}
+
+// Makes a qr code from the final message 'data' in 'qr', choosing
+// the mask according to 'strategy' (see MaskStrategy)
+// 'candidate' is scratch space for scoring the masks
+// If 'report' is not NULL it is filled in with the chosen mask
+// and how much of the penalty scoring was done
+bool create_qr_into(Version ver, ErrorLevel lvl, MaskStrategy strategy, uint8_t* data, size_t size, QrMatrix* qr, QrMatrix* candidate, MaskReport* report) {
+    if (strategy > MASK_BOUNDED) {
+        printf("create_qr(): Invalid mask strategy: %d\n", strategy);
+        return false;
+    }
+
+    // Place the data once, every mask is then an xor of its bitplane
+    if (!write_qr_template(ver, qr) || !place_data(ver, qr, data, size))
+        return false;
 
-    const uint8_t block_cnt = block_cnt_1 + block_cnt_2;
+    const uint32_t lines_per_mask = penalty_line_count(qr->side);
+    MaskReport stats = { 0 };
+
+    uint8_t chosen_one = strategy;
+    if (strategy == MASK_OPTIMAL || strategy == MASK_BOUNDED) {
+        // Evaluate every mask, keeping the lowest penalty
+        // (the first one on a tie, whatever the strategy)
+        const size_t words = qr->side * qr->row_words;
+        candidate->side = qr->side;
+        candidate->row_words = qr->row_words;
+        memcpy(candidate->reserved, qr->reserved, words * sizeof(uint64_t));
+
+        uint32_t best_penalty = UINT32_MAX;
+        for (uint8_t m = 0; m < 8; ++m) {
+            memcpy(candidate->modules, qr->modules, words * sizeof(uint64_t));
+            if (!apply_mask(ver, m, candidate))
+                return false;
+            write_format_info(lvl, m, candidate);
+
+            uint32_t lines;
+            uint32_t bound = strategy == MASK_BOUNDED ? best_penalty : UINT32_MAX;
+            uint32_t penalty = evaluate_qr_bounded(candidate, bound, &lines);
+
+            stats.lines_scored += lines;
+            if (lines == lines_per_mask)
+                ++stats.masks_scored;
+
+            if (penalty < best_penalty) {
+                best_penalty = penalty;
+                chosen_one = m;
+            }
+        }
 
-    // Generate the error correction codewords for each block in group 1
-    for (uint32_t i = 0; i < block_cnt_1; ++i) {
-        get_error_codewords(msg + msg_offset, word_cnt_1, err_words + err_offset, err_cnt);
-        msg_offset += word_cnt_1;
-        err_offset += err_cnt;
+        stats.penalty = best_penalty;
     }
 
-    // Generate the error correction codewords for each block in group 2
-    for (uint32_t i = 0; i < block_cnt_2; ++i) {
-        get_error_codewords(msg + msg_offset, word_cnt_2, err_words + err_offset, err_cnt);
-        msg_offset += word_cnt_2;
-        err_offset += err_cnt;
+    if (!apply_mask(ver, chosen_one, qr))
+        return false;
+    write_format_info(lvl, chosen_one, qr);
+
+    if (report) {
+        stats.mask = chosen_one;
+        stats.lines_skipped = 8 * lines_per_mask - stats.lines_scored;
+        *report = stats;
     }
 
-    // Structure final message
-    const size_t final_size = total_data_words + total_err_words;
-    uint8_t* final = (uint8_t*)malloc(final_size);
+    return true;
+}
+
+QrMatrix* create_qr(Version ver, ErrorLevel lvl, MaskStrategy strategy, uint8_t* data, size_t size, MaskReport* report) {
+    QrMatrix* qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+    QrMatrix candidate;
+    if (!qr) {
+        printf("create_qr(): Out of memory!\n");
+        return NULL;
+    }
+
+    if (!create_qr_into(ver, lvl, strategy, data, size, qr, &candidate, report)) {
+        free(qr);
+        return NULL;
+    }
+
+    return qr;
+}
+
+void print_qr(const QrMatrix* qr) {
+    for (uint32_t y = 0; y < qr->side; ++y) {
+        for (uint32_t x = 0; x < qr->side; ++x)
+            printf(get_module(qr, x, y) ? "#" : " ");
+
+        printf("\n");
+    }
+}
+
+BlockInfo get_block_info(Version ver, ErrorLevel lvl) {
+    return get_version_info(ver)->blocks[lvl];
+}
+
+// Lazily built data codeword interleaving permutations, one per
+// (version, error level): final[i] = msg[perm[i]]
+// Built once and published atomically, so concurrent callers
+// at worst build a copy each and all but one get thrown away
+static _Atomic(uint16_t*) data_perms[40 * 4];
+
+const uint16_t* get_data_permutation(Version ver, ErrorLevel lvl) {
+    _Atomic(uint16_t*)* slot = &data_perms[(ver - 1) * 4 + lvl];
+
+    uint16_t* perm = atomic_load_explicit(slot, memory_order_acquire);
+    if (perm)
+        return perm;
+
+    const BlockInfo info = get_block_info(ver, lvl);
+    const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+    const size_t total_data_words = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+
+    perm = (uint16_t*)malloc(total_data_words * sizeof(uint16_t));
+    if (!perm) {
+        printf("get_data_permutation(): Out of memory!\n");
+        return NULL;
+    }
 
     // Interleave message codewords
-    for (uint32_t i = 0; i < word_cnt_1; ++i) {
+    for (uint32_t i = 0; i < info.word_cnt_1; ++i) {
         for (uint32_t b = 0; b < block_cnt; ++b) {
             size_t y;
-            if (b < block_cnt_1)
-                y = b * word_cnt_1;
+            if (b < info.block_cnt_1)
+                y = b * info.word_cnt_1;
             else
-                y = block_cnt_1 * word_cnt_1 + (b - block_cnt_1) * word_cnt_2;
+                y = info.block_cnt_1 * info.word_cnt_1 + (b - info.block_cnt_1) * info.word_cnt_2;
 
-            final[i * block_cnt + b] = msg[y + i];
+            perm[i * block_cnt + b] = y + i;
         }
     }
 
     // Add on the extra words from group 2
     // If group 2 exists, the number of codewords in
     // each group 2 block is one more than group 1
-    for (uint32_t b = 0; b < block_cnt_2; ++b)
-        final[word_cnt_1 * block_cnt + b] = msg[word_cnt_1 * block_cnt_1 + (b + 1) * word_cnt_2 - 1];
+    for (uint32_t b = 0; b < info.block_cnt_2; ++b)
+        perm[info.word_cnt_1 * block_cnt + b] = info.word_cnt_1 * info.block_cnt_1 + (b + 1) * info.word_cnt_2 - 1;
+
+    uint16_t* expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(slot, &expected, perm, memory_order_acq_rel, memory_order_acquire)) {
+        // Another thread got there first
+        free(perm);
+        perm = expected;
+    }
+
+    return perm;
+}
+
+// Returns the number of codewords (data and
+// error correction) in the final message
+size_t get_final_message_size(Version ver) {
+    return get_version_info(ver)->total_words;
+}
+
+// Writes the interleaved data and error correction codewords into 'final',
+// which must hold get_final_message_size() bytes
+// The error correction codewords of each block are
+// written straight to their interleaved positions
+bool get_final_message_into(const uint8_t* msg, size_t msg_len, Version ver, ErrorLevel lvl, uint8_t* final) {
+    const BlockInfo info = get_block_info(ver, lvl);
+
+    // Verify the length of msg
+    const size_t total_data_words = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+    if (msg_len != total_data_words) {
+        printf("get_final_message(): Suspicious msg len!\n");
+        printf("Expected size: %zu, Actual size: %zu\n", total_data_words, msg_len);
+        return false;
+    }
 
-    // Interleave error correction codewords
-    for (uint32_t i = 0; i < err_cnt; ++i)
-        for (uint32_t b = 0; b < block_cnt; ++b)
-            final[msg_len + i * block_cnt + b] = err_words[b * err_cnt + i];
+    // Interleave message codewords
+    const uint16_t* perm = get_data_permutation(ver, lvl);
+    if (!perm)
+        return false;
+    for (size_t i = 0; i < msg_len; ++i)
+        final[i] = msg[perm[i]];
 
-    free(err_words);
+    // Generate the error correction codewords for each block
+    // Codeword i of block b goes to final[msg_len + i * block_cnt + b]
+    const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+    size_t msg_offset = 0;
+
+    for (uint32_t b = 0; b < block_cnt; ++b) {
+        uint8_t word_cnt = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+        get_error_codewords_strided(msg + msg_offset, word_cnt, final + msg_len + b, block_cnt, info.err_cnt);
+        msg_offset += word_cnt;
+    }
+
+    return true;
+}
+
+uint8_t* get_final_message(uint8_t* msg, size_t msg_len, Version ver, ErrorLevel lvl) {
+    uint8_t* final = (uint8_t*)malloc(get_final_message_size(ver));
+    if (!final) {
+        printf("get_final_message(): Out of memory!\n");
+        return NULL;
+    }
+
+    if (!get_final_message_into(msg, msg_len, ver, lvl, final)) {
+        free(final);
+        return NULL;
+    }
 
     return final;
 }
 
-void write_qr(const char* file, int img_width, const uint8_t* data, Version ver) {
-    uint32_t side = (ver - 1) * 4 + 21;
+// The largest number of error correction blocks (version 40-H)
+#define MAX_BLOCKS 81
+
+// Snapshot of the error correction work for a common message prefix
+// Holds the encoder state of every block after the prefix codewords,
+// so each message that starts with the prefix only encodes its suffix
+typedef struct {
+    Version ver;
+    ErrorLevel lvl;
+    size_t prefix_len;
+    RsState states[MAX_BLOCKS];
+} MessagePrefix;
+
+// Encodes the first 'prefix_len' data codewords of a message
+bool init_message_prefix(MessagePrefix* prefix, const uint8_t* msg, size_t prefix_len, Version ver, ErrorLevel lvl) {
+    const BlockInfo info = get_block_info(ver, lvl);
+    const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+
+    const size_t total_data_words = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+    if (prefix_len > total_data_words) {
+        printf("init_message_prefix(): Prefix too long!\n");
+        printf("Message size: %zu, Prefix size: %zu\n", total_data_words, prefix_len);
+        return false;
+    }
+
+    prefix->ver = ver;
+    prefix->lvl = lvl;
+    prefix->prefix_len = prefix_len;
+
+    size_t msg_offset = 0;
+    for (uint32_t b = 0; b < block_cnt; ++b) {
+        uint8_t word_cnt = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+
+        if (!rs_state_init(&prefix->states[b], info.err_cnt))
+            return false;
+        if (msg_offset < prefix_len) {
+            size_t len = prefix_len - msg_offset < word_cnt ? prefix_len - msg_offset : word_cnt;
+            rs_state_update(&prefix->states[b], msg + msg_offset, len);
+        }
+
+        msg_offset += word_cnt;
+    }
+
+    return true;
+}
+
+// Same as get_final_message_into(), but 'msg' must start with the
+// prefix given to init_message_prefix(), whose error correction
+// work is not repeated
+bool get_final_message_resume(const MessagePrefix* prefix, const uint8_t* msg, size_t msg_len, uint8_t* final) {
+    const BlockInfo info = get_block_info(prefix->ver, prefix->lvl);
+
+    // Verify the length of msg
+    const size_t total_data_words = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+    if (msg_len != total_data_words) {
+        printf("get_final_message_resume(): Suspicious msg len!\n");
+        printf("Expected size: %zu, Actual size: %zu\n", total_data_words, msg_len);
+        return false;
+    }
+
+    // Interleave message codewords
+    const uint16_t* perm = get_data_permutation(prefix->ver, prefix->lvl);
+    if (!perm)
+        return false;
+    for (size_t i = 0; i < msg_len; ++i)
+        final[i] = msg[perm[i]];
+
+    // Pick up every block where the prefix left it
+    const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+    size_t msg_offset = 0;
+
+    for (uint32_t b = 0; b < block_cnt; ++b) {
+        uint8_t word_cnt = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+        size_t block_end = msg_offset + word_cnt;
+
+        RsState state = prefix->states[b];
+        if (block_end > prefix->prefix_len) {
+            size_t start = msg_offset > prefix->prefix_len ? msg_offset : prefix->prefix_len;
+            rs_state_update(&state, msg + start, block_end - start);
+        }
+
+        rs_state_finish(&state, final + msg_len + b, block_cnt);
+        msg_offset = block_end;
+    }
+
+    return true;
+}
+
+// Same as get_final_message_into() for 'count' messages of the same
+// version and error level, such as a run of serial labels
+// The error correction codewords are computed RS_BATCH messages at a time
+bool get_final_messages_batch(const uint8_t* const* msgs, size_t msg_len, Version ver, ErrorLevel lvl, uint8_t* const* finals, size_t count) {
+    const BlockInfo info = get_block_info(ver, lvl);
+
+    // Verify the length of msg
+    const size_t total_data_words = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+    if (msg_len != total_data_words) {
+        printf("get_final_messages_batch(): Suspicious msg len!\n");
+        printf("Expected size: %zu, Actual size: %zu\n", total_data_words, msg_len);
+        return false;
+    }
+
+    const uint16_t* perm = get_data_permutation(ver, lvl);
+    if (!perm)
+        return false;
+
+    const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+
+    // One block of every message in the batch, interleaved
+    // (Blocks have at most 123 data codewords)
+    uint8_t msg_soa[123 * RS_BATCH];
+    uint8_t ec_soa[30 * RS_BATCH];
+
+    for (size_t first = 0; first < count; first += RS_BATCH) {
+        const uint32_t lanes = count - first < RS_BATCH ? count - first : RS_BATCH;
+
+        // Interleave the message codewords
+        for (uint32_t lane = 0; lane < lanes; ++lane) {
+            const uint8_t* msg = msgs[first + lane];
+            uint8_t* final = finals[first + lane];
+            for (size_t i = 0; i < msg_len; ++i)
+                final[i] = msg[perm[i]];
+        }
+
+        // Unused lanes encode zeros
+        if (lanes < RS_BATCH)
+            memset(msg_soa, 0, sizeof(msg_soa));
+
+        size_t msg_offset = 0;
+        for (uint32_t b = 0; b < block_cnt; ++b) {
+            uint8_t word_cnt = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+
+            for (uint32_t lane = 0; lane < lanes; ++lane) {
+                const uint8_t* block = msgs[first + lane] + msg_offset;
+                for (uint32_t i = 0; i < word_cnt; ++i)
+                    msg_soa[i * RS_BATCH + lane] = block[i];
+            }
+
+            get_error_codewords_batch(msg_soa, word_cnt, ec_soa, info.err_cnt);
+
+            // Codeword i of block b goes to final[msg_len + i * block_cnt + b]
+            for (uint32_t lane = 0; lane < lanes; ++lane) {
+                uint8_t* dst = finals[first + lane] + msg_len + b;
+                for (uint32_t i = 0; i < info.err_cnt; ++i)
+                    dst[i * block_cnt] = ec_soa[i * RS_BATCH + lane];
+            }
+
+            msg_offset += word_cnt;
+        }
+    }
+
+    return true;
+}
+
+// Finds the block 'b' of data codeword 'index' and its index 'i' in the block
+void locate_data_codeword(const BlockInfo* info, size_t index, uint32_t* b, uint32_t* i) {
+    const size_t group_1_words = (size_t)info->block_cnt_1 * info->word_cnt_1;
+
+    if (index < group_1_words) {
+        *b = index / info->word_cnt_1;
+        *i = index % info->word_cnt_1;
+    } else {
+        *b = info->block_cnt_1 + (index - group_1_words) / info->word_cnt_2;
+        *i = (index - group_1_words) % info->word_cnt_2;
+    }
+}
+
+// Returns the position in the final message of codeword 'i' of data block 'b'
+size_t data_codeword_position(const BlockInfo* info, uint32_t b, uint32_t i) {
+    const uint32_t block_cnt = info->block_cnt_1 + info->block_cnt_2;
+
+    // The extra codeword of group 2 blocks comes after all the others
+    if (i == info->word_cnt_1)
+        return (size_t)info->word_cnt_1 * block_cnt + (b - info->block_cnt_1);
+
+    return (size_t)i * block_cnt + b;
+}
+
+// A changed data codeword: its index in the message
+// (before interleaving) and its new value
+typedef struct {
+    uint16_t index;
+    uint8_t value;
+} CodewordEdit;
+
+// Writes the final message codeword at 'final_pos' into the qr code,
+// only touching the modules whose value changes
+// (Flipping a bit flips its module whatever the mask is)
+void replace_codeword(QrMatrix* qr, const DataModules* table, const uint8_t* final, size_t final_pos, uint8_t old_value) {
+    uint8_t changed = final[final_pos] ^ old_value;
+    for (uint32_t bit = 0; bit < 8; ++bit) {
+        if (changed >> (7 - bit) & 1) {
+            const ModulePos pos = table->positions[final_pos * 8 + bit];
+            flip_module(qr, pos.x, pos.y);
+        }
+    }
+}
+
+// Updates a qr code made by create_qr() from the final
+// message 'final' when some of its data codewords change
+// Error correction codewords are linear in the data, so the new ones
+// are the old ones xor the error correction codewords of the change,
+// computed only for the blocks that were edited
+// Only the modules of codewords that changed are rewritten
+bool update_qr(Version ver, ErrorLevel lvl, QrMatrix* qr, uint8_t* final, const CodewordEdit* edits, size_t edit_cnt) {
+    const BlockInfo info = get_block_info(ver, lvl);
+    const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+    const size_t msg_len = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+    const DataModules* table = get_data_modules(ver);
+    if (!table)
+        return false;
+
+    // The change to every edited block, zeroed when first touched
+    uint8_t delta[MAX_BLOCKS][123];
+    uint8_t first_edit[MAX_BLOCKS];
+    bool touched[MAX_BLOCKS] = { false };
+
+    // Check every edit first, so a bad one leaves the qr code untouched
+    for (size_t e = 0; e < edit_cnt; ++e) {
+        if (edits[e].index >= msg_len) {
+            printf("update_qr(): Codeword index %u out of range!\n", edits[e].index);
+            return false;
+        }
+    }
+
+    for (size_t e = 0; e < edit_cnt; ++e) {
+        uint32_t b, i;
+        locate_data_codeword(&info, edits[e].index, &b, &i);
+
+        if (!touched[b]) {
+            memset(delta[b], 0, sizeof(delta[b]));
+            first_edit[b] = i;
+            touched[b] = true;
+        }
+        if (i < first_edit[b])
+            first_edit[b] = i;
+
+        size_t final_pos = data_codeword_position(&info, b, i);
+        uint8_t old_value = final[final_pos];
+        delta[b][i] ^= old_value ^ edits[e].value;
+        final[final_pos] = edits[e].value;
+        replace_codeword(qr, table, final, final_pos, old_value);
+    }
+
+    for (uint32_t b = 0; b < block_cnt; ++b) {
+        if (!touched[b])
+            continue;
+
+        // Leading zeros of the change leave the encoder
+        // empty, so start at the first edited codeword
+        uint8_t word_cnt = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+        uint8_t err_delta[MAX_EC_WORDS];
+        get_error_codewords_strided(delta[b] + first_edit[b], word_cnt - first_edit[b], err_delta, 1, info.err_cnt);
+
+        for (uint32_t i = 0; i < info.err_cnt; ++i) {
+            if (!err_delta[i])
+                continue;
+
+            size_t final_pos = msg_len + (size_t)i * block_cnt + b;
+            uint8_t old_value = final[final_pos];
+            final[final_pos] ^= err_delta[i];
+            replace_codeword(qr, table, final, final_pos, old_value);
+        }
+    }
+
+    return true;
+}
+
+void write_qr(const char* file, int img_width, const QrMatrix* qr) {
+    uint32_t side = qr->side;
 
     if (img_width < side) {
         printf("write_qr(): image_width too small: %d\n", img_width);
@@ -585,13 +1391,15 @@ void write_qr(const char* file, int img_width, const uint8_t* data, Version ver)
     uint32_t square_width = img_width / side;
 
     for (uint32_t i = 0; i < img_width * img_width; ++i) {
-        uint8_t module = data[(i / img_width) / square_width * side + (i % img_width) / square_width];
-        if (module == 0)
-            img_data[i] = 0xff;
-        else if (module == 1)
+        uint32_t x = (i % img_width) / square_width;
+        uint32_t y = (i / img_width) / square_width;
+
+        // Pixels past the last module (when img_width
+        // is not a multiple of the side) are white
+        if (x < side && y < side && get_module(qr, x, y))
             img_data[i] = 0x00;
-        else if (module == 2)
-            img_data[i] = 0x88;
+        else
+            img_data[i] = 0xff;
     }
 
     if (!stbi_write_bmp(file, img_width, img_width, 1, img_data)) {
@@ -600,4 +1408,3 @@ void write_qr(const char* file, int img_width, const uint8_t* data, Version ver)
 
     free(img_data);
 }
-
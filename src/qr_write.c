@@ -1,241 +1,714 @@
 #include "qr.h"
+#include "version.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Taken from https://stackoverflow.com/questions/3437404/min-and-max-in-c
-#define min(a,b) \
-   ({ __typeof__ (a) _a = (a); \
-      __typeof__ (b) _b = (b); \
-    _a > _b ? _b : _a; })
-
-typedef enum {
-    MODE_ECI         = 0b0111,
-    MODE_NUMERIC     = 0b0001,
-    MODE_ALPHANUM    = 0b0010,
-    MODE_BYTE        = 0b0100,
-    MODE_KANJI       = 0b1000,
-    MODE_STRUCT_APP  = 0b0011,
-    MODE_FNC1_FIRST  = 0b0101,
-    MODE_FNC1_SECND  = 0b1001,
-} ModeIndicator;
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
+// The alphanumeric value of every byte plus one, so that
+// the bytes left out (those with no value) are 0
 // Page 21 of standard
+static const uint8_t alphanum_values[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15,
+    ['F'] = 16, ['G'] = 17, ['H'] = 18, ['I'] = 19, ['J'] = 20,
+    ['K'] = 21, ['L'] = 22, ['M'] = 23, ['N'] = 24, ['O'] = 25,
+    ['P'] = 26, ['Q'] = 27, ['R'] = 28, ['S'] = 29, ['T'] = 30,
+    ['U'] = 31, ['V'] = 32, ['W'] = 33, ['X'] = 34, ['Y'] = 35,
+    ['Z'] = 36, [' '] = 37, ['$'] = 38, ['%'] = 39, ['*'] = 40,
+    ['+'] = 41, ['-'] = 42, ['.'] = 43, ['/'] = 44, [':'] = 45,
+};
+
+// What encode_alphanumeric() returns for a byte with no value
+#define ALPHANUM_INVALID 0xFF
+
+static inline uint8_t alphanum_value(uint8_t c) {
+    return alphanum_values[c] - 1; // 0 wraps around to ALPHANUM_INVALID
+}
+
 uint8_t encode_alphanumeric(char character) {
-    switch (character) {
-        case '0': return 0;
-        case '1': return 1;
-        case '2': return 2;
-        case '3': return 3;
-        case '4': return 4;
-        case '5': return 5;
-        case '6': return 6;
-        case '7': return 7;
-        case '8': return 8;
-        case '9': return 9;
-        case 'A': return 10;
-        case 'B': return 11;
-        case 'C': return 12;
-        case 'D': return 13;
-        case 'E': return 14;
-        case 'F': return 15;
-        case 'G': return 16;
-        case 'H': return 17;
-        case 'I': return 18;
-        case 'J': return 19;
-        case 'K': return 20;
-        case 'L': return 21;
-        case 'M': return 22;
-        case 'N': return 23;
-        case 'O': return 24;
-        case 'P': return 25;
-        case 'Q': return 26;
-        case 'R': return 27;
-        case 'S': return 28;
-        case 'T': return 29;
-        case 'U': return 30;
-        case 'V': return 31;
-        case 'W': return 32;
-        case 'X': return 33;
-        case 'Y': return 34;
-        case 'Z': return 35;
-        case ' ': return 36;
-        case '$': return 37;
-        case '%': return 38;
-        case '*': return 39;
-        case '+': return 40;
-        case '-': return 41;
-        case '.': return 42;
-        case '/': return 43;
-        case ':': return 44;
-        default:  return 45;
-    }
-}
-
-// Write 8 bits to a data array at a given bit position
-void write_8(uint8_t* data, size_t data_size, uint8_t bits, size_t index) {
-    size_t array_index = index >> 3;
-    size_t byte_index = index & 0b111;
-
-    if (array_index >= data_size) {
-        printf("ERROR: write_8: Data array not big enough! Size: %zu Index: %zu\n", data_size, array_index);
+    return alphanum_value((uint8_t)character);
+}
+
+// The modes a character can be encoded in, as bits
+// Every character can be encoded in byte mode
+#define CHAR_BYTE     0
+#define CHAR_ALPHANUM 2 // Alphanumeric or byte mode
+#define CHAR_NUMERIC  3 // Any mode
+
+static inline uint8_t char_class(uint8_t c) {
+    const uint8_t value = alphanum_value(c);
+    return (value != ALPHANUM_INVALID) << 1 | (value < 10);
+}
+
+#ifdef __SSE2__
+// The vector classifiers look a byte's two nibbles up in these and AND
+// the results: a bit left set says which group of characters it is in
+// 0x01: ' ' $ % * + - . /  (0x20 - 0x2F)
+// 0x02: 0 - 9              (0x30 - 0x39)
+// 0x04: :                  (0x3A)
+// 0x08: A - O              (0x41 - 0x4F)
+// 0x10: P - Z              (0x50 - 0x5A)
+static const uint8_t class_lo_nibbles[16] = {
+    0x13, 0x1A, 0x1A, 0x1A, 0x1B, 0x1B, 0x1A, 0x1A,
+    0x1A, 0x1A, 0x1D, 0x09, 0x08, 0x09, 0x09, 0x09,
+};
+static const uint8_t class_hi_nibbles[16] = {
+    0x00, 0x00, 0x01, 0x06, 0x08, 0x10, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// 16 characters at a time
+__attribute__((target("ssse3")))
+static void classify_chars_ssse3(const uint8_t* data, size_t size, uint8_t* classes) {
+    const __m128i lo_nibbles = _mm_loadu_si128((const __m128i*)class_lo_nibbles);
+    const __m128i hi_nibbles = _mm_loadu_si128((const __m128i*)class_hi_nibbles);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i digit = _mm_set1_epi8(0x02);
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i groups = _mm_and_si128(
+            _mm_shuffle_epi8(lo_nibbles, _mm_and_si128(chars, nibble)),
+            _mm_shuffle_epi8(hi_nibbles, _mm_and_si128(_mm_srli_epi16(chars, 4), nibble)));
+
+        // CHAR_ALPHANUM unless no group, plus 1 for digits
+        __m128i alphanum = _mm_andnot_si128(_mm_cmpeq_epi8(groups, zero), digit);
+        __m128i numeric = _mm_srli_epi16(_mm_and_si128(groups, digit), 1);
+        _mm_storeu_si128((__m128i*)(classes + i), _mm_or_si128(alphanum, numeric));
+    }
+
+    for (; i < size; ++i)
+        classes[i] = char_class(data[i]);
+}
+
+// 32 characters at a time
+__attribute__((target("avx2")))
+static void classify_chars_avx2(const uint8_t* data, size_t size, uint8_t* classes) {
+    const __m256i lo_nibbles = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)class_lo_nibbles));
+    const __m256i hi_nibbles = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)class_hi_nibbles));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i digit = _mm256_set1_epi8(0x02);
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i chars = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i groups = _mm256_and_si256(
+            _mm256_shuffle_epi8(lo_nibbles, _mm256_and_si256(chars, nibble)),
+            _mm256_shuffle_epi8(hi_nibbles, _mm256_and_si256(_mm256_srli_epi16(chars, 4), nibble)));
+
+        __m256i alphanum = _mm256_andnot_si256(_mm256_cmpeq_epi8(groups, zero), digit);
+        __m256i numeric = _mm256_srli_epi16(_mm256_and_si256(groups, digit), 1);
+        _mm256_storeu_si256((__m256i*)(classes + i), _mm256_or_si256(alphanum, numeric));
+    }
+
+    classify_chars_ssse3(data + i, size - i, classes + i);
+}
+#endif
+
+// Writes the class of every character of 'data' to 'classes'
+// (CHAR_BYTE, CHAR_ALPHANUM or CHAR_NUMERIC)
+void classify_chars(const uint8_t* data, size_t size, uint8_t* classes) {
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("avx2")) {
+        classify_chars_avx2(data, size, classes);
+        return;
+    }
+
+    if (__builtin_cpu_supports("ssse3")) {
+        classify_chars_ssse3(data, size, classes);
         return;
     }
-    if (array_index < data_size)
-        data[array_index] |= bits >> byte_index;
-    if (array_index + 1 < data_size)
-        data[array_index + 1] = bits << (8 - byte_index);
+#endif
+
+    for (size_t i = 0; i < size; ++i)
+        classes[i] = char_class(data[i]);
 }
 
-// Write up to 16 bits to a data array at a given bit position
-void write_bits(uint8_t* data, size_t data_size, uint16_t bits, size_t index, size_t count) {
-    size_t array_index = index >> 3;
-    size_t byte_index = index & 0b111;
+// Characters classified at a time (on the stack)
+#define CLASS_CHUNK 256
+
+// Returns the index of the first character of 'data' that mode
+// 'mode' can't encode, or 'size' if they all can
+size_t find_invalid_char(const uint8_t* data, size_t size, ModeIndicator mode) {
+    const uint8_t need = mode == MODE_NUMERIC ? CHAR_NUMERIC : mode == MODE_ALPHANUM ? CHAR_ALPHANUM : CHAR_BYTE;
+    if (need == CHAR_BYTE)
+        return size;
+
+    // The class bits a character is missing, 8 characters at a time
+    const uint64_t missing = 0x0101010101010101 * need;
+
+    uint8_t classes[CLASS_CHUNK];
+    for (size_t start = 0; start < size; start += CLASS_CHUNK) {
+        const size_t cnt = size - start < CLASS_CHUNK ? size - start : CLASS_CHUNK;
+        classify_chars(data + start, cnt, classes);
+
+        size_t i = 0;
+        for (; i + 8 <= cnt; i += 8) {
+            uint64_t word;
+            memcpy(&word, classes + i, sizeof(word));
+            if (~word & missing)
+                break;
+        }
+        for (; i < cnt; ++i)
+            if ((classes[i] & need) != need)
+                return start + i;
+    }
 
-    bits = bits << (16 - count);
-    uint32_t shifted_bits = (uint32_t)bits << (16 - byte_index);
+    return size;
+}
+
+// Writes a big-endian bit stream into a byte array
+// The bits collect in 'acc' from the top bit down and are
+// stored 8 bytes at a time once it is full
+// The stream must fit the array (encode_data_into() checks first)
+typedef struct {
+    uint8_t* data;
+    size_t pos;   // Bytes stored so far
+    uint64_t acc;
+    uint32_t cnt; // Bits in 'acc' (always < 64)
+} BitWriter;
+
+static inline uint64_t load_be64(const uint8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void store_be64(uint8_t* bytes, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(bytes, &word, sizeof(word));
+}
+
+static inline void bit_writer_init(BitWriter* w, uint8_t* data) {
+    w->data = data;
+    w->pos = 0;
+    w->acc = 0;
+    w->cnt = 0;
+}
+
+// The bits written so far
+static inline size_t bit_writer_size(const BitWriter* w) {
+    return w->pos * 8 + w->cnt;
+}
 
-    if (array_index >= data_size) {
-        printf("ERROR: write_bits: Data array not big enough! Size: %zu Index: %zu\n", data_size, array_index);
+// Writes the low 'count' (1 - 64) bits of 'bits', the rest must be 0
+static inline void put_bits(BitWriter* w, uint64_t bits, uint32_t count) {
+    if (w->cnt + count < 64) {
+        w->acc |= bits << (64 - w->cnt - count);
+        w->cnt += count;
         return;
     }
-    if (array_index < data_size)
-        data[array_index]    |= shifted_bits >> 24;
-    if (array_index + 1 < data_size)
-        data[array_index + 1] = shifted_bits >> 16;
-    if (array_index + 2 < data_size)
-        data[array_index + 2] = shifted_bits >> 8;
+
+    // Fill the word up with the top of the field and start the next one
+    uint32_t room = 64 - w->cnt;
+    store_be64(w->data + w->pos, w->acc | bits >> (count - room));
+    w->pos += 8;
+    w->cnt = count - room;
+    w->acc = w->cnt ? bits << (64 - w->cnt) : 0;
+}
+
+// Writes 'size' whole bytes, funnel shifting 8 at a time into
+// the stream wherever it is (byte mode is 4 bits off after the mode
+// indicator, and however many the character count leaves it)
+static inline void put_bytes(BitWriter* w, const uint8_t* bytes, size_t size) {
+    const uint32_t cnt = w->cnt;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word = load_be64(bytes + i);
+        store_be64(w->data + w->pos, w->acc | word >> cnt);
+        w->pos += 8;
+        w->acc = cnt ? word << (64 - cnt) : 0;
+    }
+
+    for (; i < size; ++i)
+        put_bits(w, bytes[i], 8);
+}
+
+// Stores the bits still in the accumulator (the last byte zero padded)
+static inline void bit_writer_flush(BitWriter* w) {
+    for (uint32_t i = 0; i < w->cnt; i += 8)
+        w->data[w->pos++] = w->acc >> (56 - i);
+    w->acc = 0;
+    w->cnt = 0;
 }
 
 // Returns the number of data codewords a qr code can fit
 // Page 28 of standard
 size_t codeword_capacity(Version version, ErrorLevel err_lvl) {
-    static size_t codeword_capacities[4 * 400] = {
-        19, 16, 13, 9, 34, 28, 22, 16, 55, 44, 34, 26, 80, 64, 48, 36,
-        108, 86, 62, 46, 136, 108, 76, 60, 156, 124, 88, 66, 194, 154, 110, 86,
-        232, 182, 132, 100, 274, 216, 154, 122, 324, 254, 180, 140, 370, 290, 206, 158,
-        428, 334, 244, 180, 461, 365, 261, 197, 523, 415, 295, 223, 589, 453, 325, 253,
-        647, 507, 367, 283, 721, 563, 397, 313, 795, 627, 445, 341, 861, 669, 485, 385,
-        932, 714, 512, 406, 1006, 782, 568, 442, 1094, 860, 614, 464, 1174, 914, 664, 514,
-        1276, 1000, 718, 538, 1370, 1062, 754, 596, 1468, 1128, 808, 628, 1531, 1193, 871, 661,
-        1631, 1267, 911, 701, 1735, 1373, 985, 745, 1843, 1455, 1033, 793, 1955, 1541, 1115, 845,
-        2071, 1631, 1171, 901, 2191, 1725, 1231, 961, 2306, 1812, 1286, 986, 2434, 1914, 1354, 1054,
-        2566, 1992, 1426, 1096, 2702, 2102, 1502, 1142, 2812, 2216, 1582, 1222, 2956, 2334, 1666, 1276,
-    };
+    return get_version_info(version)->capacity[err_lvl];
+}
+
+// Numeric mode, 3 digits (10 bits) at a time
+// The vector paths turn 24 digits into 8 groups per 128 bits: pshufb
+// lines the first two digits of every group up in a 16-bit lane for
+// pmaddubsw (x 100 and x 10) and the third in another, pmaddwd joins
+// pairs of groups into 20 bits and a 64-bit multiply pairs of those
+// into 40, which go to the writer. They stop at the first block with
+// a character that isn't a digit, leaving it to the scalar code
 
-    return codeword_capacities[(version - 1) * 4 + err_lvl];
+#ifdef __SSE2__
+// Digits 0 - 15 go in 'lo' and 8 - 23 in 'hi'
+// Groups 0 - 4 come from 'lo' and groups 5 - 7 from 'hi'
+#define Z -1
+static const int8_t numeric_pairs_lo[16] = { 0, 1, 3, 4, 6, 7, 9, 10, 12, 13, Z, Z, Z, Z, Z, Z };
+static const int8_t numeric_pairs_hi[16] = { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 7, 8, 10, 11, 13, 14 };
+static const int8_t numeric_units_lo[16] = { 2, Z, 5, Z, 8, Z, 11, Z, 14, Z, Z, Z, Z, Z, Z, Z };
+static const int8_t numeric_units_hi[16] = { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 9, Z, 12, Z, 15, Z };
+#undef Z
+
+// Converts 24 digits (as in numeric_pairs_lo) into two 40-bit
+// halves of the stream, and returns the lanes that are digits
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i numeric_block_ssse3(__m128i lo, __m128i hi, __m128i* halves) {
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+
+    lo = _mm_sub_epi8(lo, zero);
+    hi = _mm_sub_epi8(hi, zero);
+    __m128i valid = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(lo, nine), nine), _mm_cmpeq_epi8(_mm_max_epu8(hi, nine), nine));
+
+    __m128i pairs = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_loadu_si128((const __m128i*)numeric_pairs_lo)),
+        _mm_shuffle_epi8(hi, _mm_loadu_si128((const __m128i*)numeric_pairs_hi)));
+    __m128i units = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_loadu_si128((const __m128i*)numeric_units_lo)),
+        _mm_shuffle_epi8(hi, _mm_loadu_si128((const __m128i*)numeric_units_hi)));
+    __m128i groups = _mm_add_epi16(_mm_maddubs_epi16(pairs, _mm_set1_epi16(10 << 8 | 100)), units);
+
+    __m128i twenty = _mm_madd_epi16(groups, _mm_set1_epi32(1 << 16 | 1 << 10));
+    *halves = _mm_or_si128(_mm_mul_epu32(twenty, _mm_set1_epi64x(1 << 20)), _mm_srli_epi64(twenty, 32));
+
+    return valid;
 }
 
-// Encodes array of data into data codewords
-// Page 17 of standard
-void encode_data(const uint8_t* data, size_t size, ModeIndicator mode, Symbol* sym) {
-    size_t codeword_cnt = codeword_capacity(sym->version, sym->err_lvl);
-    uint8_t* codewords  = malloc(codeword_cnt);
-    memset(codewords, 0, codeword_cnt);
+__attribute__((target("ssse3")))
+static size_t put_numeric_ssse3(BitWriter* w, const uint8_t* data, size_t size) {
+    size_t i = 0;
+    for (; i + 24 <= size; i += 24) {
+        __m128i halves;
+        __m128i valid = numeric_block_ssse3(_mm_loadu_si128((const __m128i*)(data + i)),
+            _mm_loadu_si128((const __m128i*)(data + i + 8)), &halves);
+        if (_mm_movemask_epi8(valid) != 0xFFFF)
+            break;
 
-    codewords[0] = mode << 4;
-    size_t index = 4; // The bit index into codewords
+        uint64_t out[2];
+        _mm_storeu_si128((__m128i*)out, halves);
+        put_bits(w, out[0], 40);
+        put_bits(w, out[1], 40);
+    }
+
+    return i;
+}
+
+// 48 digits at a time, 24 in each 128-bit lane
+__attribute__((target("avx2")))
+static size_t put_numeric_avx2(BitWriter* w, const uint8_t* data, size_t size) {
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i pairs_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)numeric_pairs_lo));
+    const __m256i pairs_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)numeric_pairs_hi));
+    const __m256i units_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)numeric_units_lo));
+    const __m256i units_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)numeric_units_hi));
+
+    size_t i = 0;
+    for (; i + 48 <= size; i += 48) {
+        const uint8_t* block = data + i;
+        __m256i lo = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)block)),
+            _mm_loadu_si128((const __m128i*)(block + 24)), 1);
+        __m256i hi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(block + 8))),
+            _mm_loadu_si128((const __m128i*)(block + 32)), 1);
+
+        lo = _mm256_sub_epi8(lo, zero);
+        hi = _mm256_sub_epi8(hi, zero);
+        __m256i valid = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(lo, nine), nine), _mm256_cmpeq_epi8(_mm256_max_epu8(hi, nine), nine));
+        if (_mm256_movemask_epi8(valid) != -1)
+            break;
+
+        __m256i pairs = _mm256_or_si256(_mm256_shuffle_epi8(lo, pairs_lo), _mm256_shuffle_epi8(hi, pairs_hi));
+        __m256i units = _mm256_or_si256(_mm256_shuffle_epi8(lo, units_lo), _mm256_shuffle_epi8(hi, units_hi));
+        __m256i groups = _mm256_add_epi16(_mm256_maddubs_epi16(pairs, _mm256_set1_epi16(10 << 8 | 100)), units);
+
+        __m256i twenty = _mm256_madd_epi16(groups, _mm256_set1_epi32(1 << 16 | 1 << 10));
+        __m256i halves = _mm256_or_si256(_mm256_mul_epu32(twenty, _mm256_set1_epi64x(1 << 20)), _mm256_srli_epi64(twenty, 32));
+
+        uint64_t out[4];
+        _mm256_storeu_si256((__m256i*)out, halves);
+        put_bits(w, out[0], 40);
+        put_bits(w, out[1], 40);
+        put_bits(w, out[2], 40);
+        put_bits(w, out[3], 40);
+    }
+
+    // One more block of 24
+    return i + put_numeric_ssse3(w, data + i, size - i);
+}
+#endif
+
+// Writes the digits of 'data' in groups of 3, then the 1 or 2 left over
+// Returns false (and prints why) at the first character that isn't a digit
+static bool put_numeric(BitWriter* w, const uint8_t* data, size_t size) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (size >= 24) {
+        if (__builtin_cpu_supports("avx2"))
+            i = put_numeric_avx2(w, data, size);
+        else if (__builtin_cpu_supports("ssse3"))
+            i = put_numeric_ssse3(w, data, size);
+    }
+#endif
+
+    for (size_t k = i; k < size; ++k) {
+        if ((uint8_t)(data[k] - '0') > 9) {
+            printf("put_numeric(): Not a digit: 0x%02x at %zu\n", data[k], k);
+            return false;
+        }
+    }
+
+    // The number is split into blocks of 3 digits
+    // which are then converted into binary 
+    for (; i < size - (size % 3); i += 3) {
+        // The binary representation of 3 base-10 digits
+        uint16_t chunk = (data[i] - '0') * 100;
+        chunk += (data[i + 1] - '0') * 10;
+        chunk += (data[i + 2] - '0');
+        put_bits(w, chunk, 10);
+    }
+
+    // Account for remaining digits
+    if (size - i == 1) {        // 1 remaining digit
+        put_bits(w, data[i] - '0', 4);
+    } else if (size - i == 2) { // 2 remaining digits
+        uint16_t chunk = (data[i] - '0') * 10 + (data[i + 1] - '0');
+        put_bits(w, chunk, 7);
+    }
+
+    return true;
+}
+
+// Writes a segment: the mode indicator, the character count and
+// 'size' characters of 'data' in mode 'mode'
+// Returns false (and prints why) if 'data' has characters the mode can't encode
+// Page 17 of standard
+static bool write_segment(BitWriter* w, const uint8_t* data, size_t size, ModeIndicator mode, Version version) {
+    put_bits(w, mode, 4);
 
     switch (mode) {
         case MODE_NUMERIC: {
             // The number of bits in the character count
-            uint8_t char_cnt_len;
-            if (sym->version < 10)      char_cnt_len = 10;
-            else if (sym->version < 27) char_cnt_len = 12;
-            else                        char_cnt_len = 14;
-
-            write_bits(codewords, codeword_cnt, (uint16_t)size, index, char_cnt_len);
-            index += char_cnt_len;
-
-            // The number is split into blocks of 3 digits
-            // which are then converted into binary 
-            int i = 0;
-            for (; i < size - (size % 3); i += 3) {
-                // The binary representation of 3 base-10 digits
-                uint16_t chunk = (data[i] - '0') * 100;
-                chunk += (data[i + 1] - '0') * 10;
-                chunk += (data[i + 2] - '0');
-                write_bits(codewords, codeword_cnt, chunk, index, 10);
-                index += 10;
-            }
+            uint8_t char_cnt_len = get_version_info(version)->char_cnt_bits[CHAR_CNT_NUMERIC];
+            put_bits(w, size, char_cnt_len);
 
-            // Account for remaining digits
-            if (size - i == 1) {        // 1 remaining digit
-                write_bits(codewords, codeword_cnt, data[i] - '0', index, 4);
-                index += 4;
-            } else if (size - i == 2) { // 2 remaining digits
-                uint16_t chunk = (data[i] - '0') * 10 + (data[i + 1] - '0');
-                write_bits(codewords, codeword_cnt, chunk, index, 7);
-                index += 7;
-            }
+            if (!put_numeric(w, data, size))
+                return false;
         } break; // case NUMERIC
 
         case MODE_ALPHANUM: {
             // The number of bits in the character count
-            uint8_t char_cnt_len;
-            if (sym->version < 10)      char_cnt_len = 9;
-            else if (sym->version < 27) char_cnt_len = 11;
-            else                        char_cnt_len = 13;
-
-            write_bits(codewords, codeword_cnt, (uint16_t)size, index, char_cnt_len);
-            index += char_cnt_len;
+            uint8_t char_cnt_len = get_version_info(version)->char_cnt_bits[CHAR_CNT_ALPHANUM];
+            put_bits(w, size, char_cnt_len);
 
             // The text is split into groups of 2 characters
-            int i = 0;
+            size_t i = 0;
             for (; i < size - (size % 2); i += 2) {
                 // The binary encodation of 2 alpha numeric characters
-                uint16_t chunk = encode_alphanumeric(data[i]) * 45;
-                chunk += encode_alphanumeric(data[i + 1]);
-                write_bits(codewords, codeword_cnt, chunk, index, 11);
-                index += 11;
+                uint16_t chunk = alphanum_value(data[i]) * 45;
+                chunk += alphanum_value(data[i + 1]);
+                put_bits(w, chunk, 11);
             }
 
             // Account for any remaining character
-            if (size - i) {
-                write_bits(codewords, codeword_cnt, encode_alphanumeric(data[i]), index, 6);
-                index += 6;
-            }
+            if (size - i)
+                put_bits(w, alphanum_value(data[i]), 6);
         } break; // case ALPHANUMERIC
         
         case MODE_BYTE: {
             // The number of bits in the character count
-            uint8_t char_cnt_len;
-            if (sym->version < 10) char_cnt_len = 8;
-            else                   char_cnt_len = 16;
+            uint8_t char_cnt_len = get_version_info(version)->char_cnt_bits[CHAR_CNT_BYTE];
+            put_bits(w, size, char_cnt_len);
 
-            write_bits(codewords, codeword_cnt, (uint16_t)size, index, char_cnt_len);
-            index += char_cnt_len;
-
-            for (int i = 0; i < size; i += 1) {
-                write_8(codewords, codeword_cnt, data[i], index);
-                index += 8;
-            }
+            put_bytes(w, data, size);
         } break; // case Byte
 
         default: {
             printf("ERROR: MODE NOT SUPPROTED!\n");
+            return false;
         }
     }
 
-    // Add the terminator "0000"
-    index = min(index + 4, codeword_cnt * 8);
+    return true;
+}
 
-    // Round up to the nearest multiple of 8
-    size_t nearest = index + 7 - (index - 1) % 8;
-    index = min(nearest, codeword_cnt * 8);
+// Adds the terminator and the padding after the last segment,
+// filling the 'codeword_cnt' codewords
+static void write_padding(BitWriter* w, size_t codeword_cnt) {
+    const size_t end = codeword_cnt * 8;
 
-    // Add pad codewords
-    while (index < codeword_cnt * 8) {
-        write_8(codewords, codeword_cnt, 0b11101100, index);
-        index += 8;
+    // Add the terminator "0000" (or as much of it as fits)
+    // and round up to the nearest multiple of 8
+    size_t index = bit_writer_size(w);
+    size_t terminator = end - index < 4 ? end - index : 4;
+    terminator += (8 - (index + terminator) % 8) % 8;
+    if (terminator)
+        put_bits(w, 0, terminator);
 
-        if (index >= codeword_cnt * 8)
-            break;
+    // Add pad codewords, two at a time
+    size_t pad_cnt = codeword_cnt - bit_writer_size(w) / 8;
+    for (; pad_cnt >= 2; pad_cnt -= 2)
+        put_bits(w, 0b1110110000010001, 16);
+    if (pad_cnt)
+        put_bits(w, 0b11101100, 8);
+
+    bit_writer_flush(w);
+}
+
+// The bits a segment of 'size' characters in mode 'mode' takes
+size_t segment_bits(size_t size, ModeIndicator mode, Version version) {
+    const uint8_t* char_cnt_bits = get_version_info(version)->char_cnt_bits;
+
+    switch (mode) {
+        case MODE_NUMERIC:  return 4 + char_cnt_bits[CHAR_CNT_NUMERIC] + size / 3 * 10 + (size % 3 == 2 ? 7 : size % 3 * 4);
+        case MODE_ALPHANUM: return 4 + char_cnt_bits[CHAR_CNT_ALPHANUM] + size / 2 * 11 + size % 2 * 6;
+        case MODE_BYTE:     return 4 + char_cnt_bits[CHAR_CNT_BYTE] + size * 8;
+        default:            return 0;
+    }
+}
+
+// The most characters one segment can hold
+static size_t max_segment_size(ModeIndicator mode, Version version) {
+    const uint8_t* char_cnt_bits = get_version_info(version)->char_cnt_bits;
+    uint8_t bits = mode == MODE_NUMERIC ? char_cnt_bits[CHAR_CNT_NUMERIC] :
+        mode == MODE_ALPHANUM ? char_cnt_bits[CHAR_CNT_ALPHANUM] : char_cnt_bits[CHAR_CNT_BYTE];
+    return ((size_t)1 << bits) - 1;
+}
+
+// Segmentation (ISO 18004 annex J, done exactly instead of with the
+// rules of thumb there)
+// The modes a character can be encoded in, in the order of 'seg_modes'
+#define SEG_NUMERIC  0
+#define SEG_ALPHANUM 1
+#define SEG_BYTE     2
+#define SEG_MODE_CNT 3
+#define SEG_NONE     3
+
+static const ModeIndicator seg_modes[SEG_MODE_CNT] = { MODE_NUMERIC, MODE_ALPHANUM, MODE_BYTE };
+
+// Picks the mode of every character of 'data' so that the segments
+// (the runs of characters with the same mode) take the fewest bits
+// at 'version', writing them to 'modes' ('size' entries)
+// Returns the total bits of the segments (see encode_segments_into())
+// If 'modes' is NULL only the bits are worked out
+// Every character ends a segment in each mode at the lowest cost
+// it can, with costs in sixths of a bit so that numeric (10 bits
+// per 3 digits) and alphanumeric (11 bits per 2) characters count
+// exactly. 'modes' first records, for every character and every
+// mode the segment after it can be in, the mode of the character's
+// own segment (2 bits each), and is then overwritten going backwards
+// Kanji mode is not used: the data is bytes in no particular encoding
+size_t choose_segments(const uint8_t* data, size_t size, Version version, uint8_t* modes) {
+    if (size == 0)
+        return 0;
+
+    const uint8_t* char_cnt_bits = get_version_info(version)->char_cnt_bits;
+    const uint32_t head_costs[SEG_MODE_CNT] = {
+        (4 + char_cnt_bits[CHAR_CNT_NUMERIC]) * 6,
+        (4 + char_cnt_bits[CHAR_CNT_ALPHANUM]) * 6,
+        (4 + char_cnt_bits[CHAR_CNT_BYTE]) * 6,
+    };
+
+    uint32_t costs[SEG_MODE_CNT] = { head_costs[0], head_costs[1], head_costs[2] };
+    uint8_t classes[CLASS_CHUNK];
+    for (size_t i = 0; i < size; ++i) {
+        uint32_t next[SEG_MODE_CNT] = { UINT32_MAX, UINT32_MAX, UINT32_MAX };
+        uint8_t from[SEG_MODE_CNT] = { SEG_NONE, SEG_NONE, SEG_NONE };
+
+        if (i % CLASS_CHUNK == 0)
+            classify_chars(data + i, size - i < CLASS_CHUNK ? size - i : CLASS_CHUNK, classes);
+        const uint8_t class = classes[i % CLASS_CHUNK];
+
+        // Carry on the segment the character is in
+        next[SEG_BYTE] = costs[SEG_BYTE] + 48;
+        from[SEG_BYTE] = SEG_BYTE;
+        if (class & CHAR_ALPHANUM) {
+            next[SEG_ALPHANUM] = costs[SEG_ALPHANUM] + 33;
+            from[SEG_ALPHANUM] = SEG_ALPHANUM;
+        }
+        if (class == CHAR_NUMERIC) {
+            next[SEG_NUMERIC] = costs[SEG_NUMERIC] + 20;
+            from[SEG_NUMERIC] = SEG_NUMERIC;
+        }
+
+        // Or end it here and start a segment in another mode
+        uint32_t ends[SEG_MODE_CNT];
+        for (uint32_t k = 0; k < SEG_MODE_CNT; ++k)
+            ends[k] = from[k] == SEG_NONE ? UINT32_MAX : (next[k] + 5) / 6 * 6;
+        for (uint32_t j = 0; j < SEG_MODE_CNT; ++j) {
+            for (uint32_t k = 0; k < SEG_MODE_CNT; ++k) {
+                if (ends[k] != UINT32_MAX && ends[k] + head_costs[j] < next[j]) {
+                    next[j] = ends[k] + head_costs[j];
+                    from[j] = k;
+                }
+            }
+        }
+
+        if (modes)
+            modes[i] = from[SEG_NUMERIC] | from[SEG_ALPHANUM] << 2 | from[SEG_BYTE] << 4;
+        memcpy(costs, next, sizeof(costs));
+    }
+
+    // The cheapest way to end, then back to the start
+    uint32_t mode = SEG_NUMERIC;
+    for (uint32_t j = 1; j < SEG_MODE_CNT; ++j)
+        if (costs[j] < costs[mode])
+            mode = j;
+
+    // Rounding up the last segment makes this exact
+    const size_t bits = (costs[mode] + 5) / 6;
 
-        write_8(codewords, codeword_cnt, 0b00010001, index);
-        index += 8;
+    if (modes) {
+        for (size_t i = size; i-- > 0;) {
+            mode = modes[i] >> (2 * mode) & 3;
+            modes[i] = seg_modes[mode];
+        }
+    }
+
+    return bits;
+}
+
+// The bits 'size' bytes of 'data' take in mode 'mode' at 'version',
+// without encoding them (MODE_AUTO: with the segments choose_segments() picks)
+size_t data_bit_size(const uint8_t* data, size_t size, ModeIndicator mode, Version version) {
+    return mode == MODE_AUTO ? choose_segments(data, size, version, NULL) : segment_bits(size, mode, version);
+}
+
+// Returns the smallest version 'size' bytes of 'data' fit in at
+// 'err_lvl', or 0 if they don't fit any version
+// The bit size only changes with the character count widths, so it is
+// worked out once per width class (versions 1-9, 10-26 and 27-40)
+Version choose_version(const uint8_t* data, size_t size, ModeIndicator mode, ErrorLevel err_lvl) {
+    size_t bits = 0;
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        const VersionInfo* info = get_version_info(ver);
+        if (ver == 1 || memcmp(info->char_cnt_bits, get_version_info(ver - 1)->char_cnt_bits, sizeof(info->char_cnt_bits)) != 0)
+            bits = data_bit_size(data, size, mode, ver);
+
+        if (bits <= info->capacity[err_lvl] * 8)
+            return ver;
+    }
+
+    return 0;
+}
+
+// Encodes array of data into data codewords as the segments
+// chosen by choose_segments() ('modes' has the mode of every character)
+// 'codewords' must hold codeword_capacity() bytes
+// Returns false (and prints why) if the segments don't fit
+bool encode_segments_into(const uint8_t* data, size_t size, const uint8_t* modes, Version version, ErrorLevel err_lvl, uint8_t* codewords) {
+    size_t codeword_cnt = codeword_capacity(version, err_lvl);
+
+    size_t bits = 0;
+    for (size_t i = 0, end; i < size; i = end) {
+        for (end = i + 1; end < size && modes[end] == modes[i]; ++end);
+        bits += segment_bits(end - i, modes[i], version);
+    }
+
+    if (bits > codeword_cnt * 8) {
+        printf("encode_segments_into(): Too much data! Bits: %zu Capacity: %zu\n", bits, codeword_cnt * 8);
+        return false;
+    }
+
+    BitWriter w;
+    bit_writer_init(&w, codewords);
+    for (size_t i = 0, end; i < size; i = end) {
+        // Runs too long for the character count become several segments
+        size_t max_size = max_segment_size(modes[i], version);
+        for (end = i + 1; end < size && end - i < max_size && modes[end] == modes[i]; ++end);
+        if (!write_segment(&w, data + i, end - i, modes[i], version))
+            return false;
+    }
+
+    write_padding(&w, codeword_cnt);
+
+    return true;
+}
+
+// Encodes array of data into data codewords
+// 'codewords' must hold codeword_capacity() bytes
+// MODE_AUTO is not handled here, see choose_segments()
+// Returns false (and prints why) if the data doesn't fit
+// or has characters the mode can't encode
+bool encode_data_into(const uint8_t* data, size_t size, ModeIndicator mode, Version version, ErrorLevel err_lvl, uint8_t* codewords) {
+    size_t codeword_cnt = codeword_capacity(version, err_lvl);
+
+    size_t bits = segment_bits(size, mode, version);
+    if (bits > codeword_cnt * 8) {
+        printf("encode_data_into(): Too much data! Bits: %zu Capacity: %zu\n", bits, codeword_cnt * 8);
+        return false;
+    }
+
+    // Characters the mode can't encode are rejected before anything is written
+    size_t invalid = find_invalid_char(data, size, mode);
+    if (invalid < size) {
+        printf("encode_data_into(): Invalid character for mode %d: 0x%02x at %zu\n", mode, data[invalid], invalid);
+        return false;
+    }
+
+    BitWriter w;
+    bit_writer_init(&w, codewords);
+    if (!write_segment(&w, data, size, mode, version))
+        return false;
+    write_padding(&w, codeword_cnt);
+
+    return true;
+}
+
+// Encodes array of data into the data codewords of 'sym'
+// If the version of 'sym' is VERSION_AUTO it is set to the
+// smallest version the data fits in
+// Returns false (and prints why) if the data doesn't fit
+bool encode_data(const uint8_t* data, size_t size, ModeIndicator mode, Symbol* sym) {
+    if (sym->version == VERSION_AUTO) {
+        Version version = choose_version(data, size, mode, sym->err_lvl);
+        if (version == 0) {
+            printf("encode_data(): Too much data for any version! Size: %zu\n", size);
+            return false;
+        }
+        sym->version = version;
+    }
+
+    size_t codeword_cnt = codeword_capacity(sym->version, sym->err_lvl);
+    uint8_t* codewords  = malloc(codeword_cnt);
+
+    bool encoded;
+    if (mode == MODE_AUTO) {
+        uint8_t* modes = malloc(size);
+        choose_segments(data, size, sym->version, modes);
+        encoded = encode_segments_into(data, size, modes, sym->version, sym->err_lvl, codewords);
+        free(modes);
+    } else {
+        encoded = encode_data_into(data, size, mode, sym->version, sym->err_lvl, codewords);
+    }
+
+    if (!encoded) {
+        free(codewords);
+        return false;
     }
 
     if (sym->data_size != 0)
@@ -243,4 +716,6 @@ void encode_data(const uint8_t* data, size_t size, ModeIndicator mode, Symbol* s
 
     sym->data = codewords;
     sym->data_size = codeword_cnt;
+
+    return true;
 }
@@ -0,0 +1,212 @@
+#include "version.h"
+
+// Field order: side, alignment pattern count and coordinates,
+// remainder bits, character count bits (numeric, alphanumeric, byte),
+// version information, total codewords, data codewords per error
+// level, and the block structure per error level
+// Data taken from the standard and
+// https://www.thonky.com/qr-code-tutorial/error-correction-table
+// https://www.thonky.com/qr-code-tutorial/alignment-pattern-locations
+// https://www.thonky.com/qr-code-tutorial/format-version-tables
+const VersionInfo version_table[40] = {
+    { // Version 1
+        21, 0, { 0 }, 0, { 10, 9, 8 }, 0, 26,
+        { 19, 16, 13, 9 },
+        { { 7, 1, 19, 0, 0 }, { 10, 1, 16, 0, 0 }, { 13, 1, 13, 0, 0 }, { 17, 1, 9, 0, 0 } },
+    },
+    { // Version 2
+        25, 2, { 6, 18 }, 7, { 10, 9, 8 }, 0, 44,
+        { 34, 28, 22, 16 },
+        { { 10, 1, 34, 0, 0 }, { 16, 1, 28, 0, 0 }, { 22, 1, 22, 0, 0 }, { 28, 1, 16, 0, 0 } },
+    },
+    { // Version 3
+        29, 2, { 6, 22 }, 7, { 10, 9, 8 }, 0, 70,
+        { 55, 44, 34, 26 },
+        { { 15, 1, 55, 0, 0 }, { 26, 1, 44, 0, 0 }, { 18, 2, 17, 0, 0 }, { 22, 2, 13, 0, 0 } },
+    },
+    { // Version 4
+        33, 2, { 6, 26 }, 7, { 10, 9, 8 }, 0, 100,
+        { 80, 64, 48, 36 },
+        { { 20, 1, 80, 0, 0 }, { 18, 2, 32, 0, 0 }, { 26, 2, 24, 0, 0 }, { 16, 4, 9, 0, 0 } },
+    },
+    { // Version 5
+        37, 2, { 6, 30 }, 7, { 10, 9, 8 }, 0, 134,
+        { 108, 86, 62, 46 },
+        { { 26, 1, 108, 0, 0 }, { 24, 2, 43, 0, 0 }, { 18, 2, 15, 2, 16 }, { 22, 2, 11, 2, 12 } },
+    },
+    { // Version 6
+        41, 2, { 6, 34 }, 7, { 10, 9, 8 }, 0, 172,
+        { 136, 108, 76, 60 },
+        { { 18, 2, 68, 0, 0 }, { 16, 4, 27, 0, 0 }, { 24, 4, 19, 0, 0 }, { 28, 4, 15, 0, 0 } },
+    },
+    { // Version 7
+        45, 3, { 6, 22, 38 }, 0, { 10, 9, 8 }, 0b000111110010010100, 196,
+        { 156, 124, 88, 66 },
+        { { 20, 2, 78, 0, 0 }, { 18, 4, 31, 0, 0 }, { 18, 2, 14, 4, 15 }, { 26, 4, 13, 1, 14 } },
+    },
+    { // Version 8
+        49, 3, { 6, 24, 42 }, 0, { 10, 9, 8 }, 0b001000010110111100, 242,
+        { 194, 154, 110, 86 },
+        { { 24, 2, 97, 0, 0 }, { 22, 2, 38, 2, 39 }, { 22, 4, 18, 2, 19 }, { 26, 4, 14, 2, 15 } },
+    },
+    { // Version 9
+        53, 3, { 6, 26, 46 }, 0, { 10, 9, 8 }, 0b001001101010011001, 292,
+        { 232, 182, 132, 100 },
+        { { 30, 2, 116, 0, 0 }, { 22, 3, 36, 2, 37 }, { 20, 4, 16, 4, 17 }, { 24, 4, 12, 4, 13 } },
+    },
+    { // Version 10
+        57, 3, { 6, 28, 50 }, 0, { 12, 11, 16 }, 0b001010010011010011, 346,
+        { 274, 216, 154, 122 },
+        { { 18, 2, 68, 2, 69 }, { 26, 4, 43, 1, 44 }, { 24, 6, 19, 2, 20 }, { 28, 6, 15, 2, 16 } },
+    },
+    { // Version 11
+        61, 3, { 6, 30, 54 }, 0, { 12, 11, 16 }, 0b001011101111110110, 404,
+        { 324, 254, 180, 140 },
+        { { 20, 4, 81, 0, 0 }, { 30, 1, 50, 4, 51 }, { 28, 4, 22, 4, 23 }, { 24, 3, 12, 8, 13 } },
+    },
+    { // Version 12
+        65, 3, { 6, 32, 58 }, 0, { 12, 11, 16 }, 0b001100011101100010, 466,
+        { 370, 290, 206, 158 },
+        { { 24, 2, 92, 2, 93 }, { 22, 6, 36, 2, 37 }, { 26, 4, 20, 6, 21 }, { 28, 7, 14, 4, 15 } },
+    },
+    { // Version 13
+        69, 3, { 6, 34, 62 }, 0, { 12, 11, 16 }, 0b001101100001000111, 532,
+        { 428, 334, 244, 180 },
+        { { 26, 4, 107, 0, 0 }, { 22, 8, 37, 1, 38 }, { 24, 8, 20, 4, 21 }, { 22, 12, 11, 4, 12 } },
+    },
+    { // Version 14
+        73, 4, { 6, 26, 46, 66 }, 3, { 12, 11, 16 }, 0b001110011000001101, 581,
+        { 461, 365, 261, 197 },
+        { { 30, 3, 115, 1, 116 }, { 24, 4, 40, 5, 41 }, { 20, 11, 16, 5, 17 }, { 24, 11, 12, 5, 13 } },
+    },
+    { // Version 15
+        77, 4, { 6, 26, 48, 70 }, 3, { 12, 11, 16 }, 0b001111100100101000, 655,
+        { 523, 415, 295, 223 },
+        { { 22, 5, 87, 1, 88 }, { 24, 5, 41, 5, 42 }, { 30, 5, 24, 7, 25 }, { 24, 11, 12, 7, 13 } },
+    },
+    { // Version 16
+        81, 4, { 6, 26, 50, 74 }, 3, { 12, 11, 16 }, 0b010000101101111000, 733,
+        { 589, 453, 325, 253 },
+        { { 24, 5, 98, 1, 99 }, { 28, 7, 45, 3, 46 }, { 24, 15, 19, 2, 20 }, { 30, 3, 15, 13, 16 } },
+    },
+    { // Version 17
+        85, 4, { 6, 30, 54, 78 }, 3, { 12, 11, 16 }, 0b010001010001011101, 815,
+        { 647, 507, 367, 283 },
+        { { 28, 1, 107, 5, 108 }, { 28, 10, 46, 1, 47 }, { 28, 1, 22, 15, 23 }, { 28, 2, 14, 17, 15 } },
+    },
+    { // Version 18
+        89, 4, { 6, 30, 56, 82 }, 3, { 12, 11, 16 }, 0b010010101000010111, 901,
+        { 721, 563, 397, 313 },
+        { { 30, 5, 120, 1, 121 }, { 26, 9, 43, 4, 44 }, { 28, 17, 22, 1, 23 }, { 28, 2, 14, 19, 15 } },
+    },
+    { // Version 19
+        93, 4, { 6, 30, 58, 86 }, 3, { 12, 11, 16 }, 0b010011010100110010, 991,
+        { 795, 627, 445, 341 },
+        { { 28, 3, 113, 4, 114 }, { 26, 3, 44, 11, 45 }, { 26, 17, 21, 4, 22 }, { 26, 9, 13, 16, 14 } },
+    },
+    { // Version 20
+        97, 4, { 6, 34, 62, 90 }, 3, { 12, 11, 16 }, 0b010100100110100110, 1085,
+        { 861, 669, 485, 385 },
+        { { 28, 3, 107, 5, 108 }, { 26, 3, 41, 13, 42 }, { 30, 15, 24, 5, 25 }, { 28, 15, 15, 10, 16 } },
+    },
+    { // Version 21
+        101, 5, { 6, 28, 50, 72, 94 }, 4, { 12, 11, 16 }, 0b010101011010000011, 1156,
+        { 932, 714, 512, 406 },
+        { { 28, 4, 116, 4, 117 }, { 26, 17, 42, 0, 0 }, { 28, 17, 22, 6, 23 }, { 30, 19, 16, 6, 17 } },
+    },
+    { // Version 22
+        105, 5, { 6, 26, 50, 74, 98 }, 4, { 12, 11, 16 }, 0b010110100011001001, 1258,
+        { 1006, 782, 568, 442 },
+        { { 28, 2, 111, 7, 112 }, { 28, 17, 46, 0, 0 }, { 30, 7, 24, 16, 25 }, { 24, 34, 13, 0, 0 } },
+    },
+    { // Version 23
+        109, 5, { 6, 30, 54, 78, 102 }, 4, { 12, 11, 16 }, 0b010111011111101100, 1364,
+        { 1094, 860, 614, 464 },
+        { { 30, 4, 121, 5, 122 }, { 28, 4, 47, 14, 48 }, { 30, 11, 24, 14, 25 }, { 30, 16, 15, 14, 16 } },
+    },
+    { // Version 24
+        113, 5, { 6, 28, 54, 80, 106 }, 4, { 12, 11, 16 }, 0b011000111011000100, 1474,
+        { 1174, 914, 664, 514 },
+        { { 30, 6, 117, 4, 118 }, { 28, 6, 45, 14, 46 }, { 30, 11, 24, 16, 25 }, { 30, 30, 16, 2, 17 } },
+    },
+    { // Version 25
+        117, 5, { 6, 32, 58, 84, 110 }, 4, { 12, 11, 16 }, 0b011001000111100001, 1588,
+        { 1276, 1000, 718, 538 },
+        { { 26, 8, 106, 4, 107 }, { 28, 8, 47, 13, 48 }, { 30, 7, 24, 22, 25 }, { 30, 22, 15, 13, 16 } },
+    },
+    { // Version 26
+        121, 5, { 6, 30, 58, 86, 114 }, 4, { 12, 11, 16 }, 0b011010111110101011, 1706,
+        { 1370, 1062, 754, 596 },
+        { { 28, 10, 114, 2, 115 }, { 28, 19, 46, 4, 47 }, { 28, 28, 22, 6, 23 }, { 30, 33, 16, 4, 17 } },
+    },
+    { // Version 27
+        125, 5, { 6, 34, 62, 90, 118 }, 4, { 14, 13, 16 }, 0b011011000010001110, 1828,
+        { 1468, 1128, 808, 628 },
+        { { 30, 8, 122, 4, 123 }, { 28, 22, 45, 3, 46 }, { 30, 8, 23, 26, 24 }, { 30, 12, 15, 28, 16 } },
+    },
+    { // Version 28
+        129, 6, { 6, 26, 50, 74, 98, 122 }, 3, { 14, 13, 16 }, 0b011100110000011010, 1921,
+        { 1531, 1193, 871, 661 },
+        { { 30, 3, 117, 10, 118 }, { 28, 3, 45, 23, 46 }, { 30, 4, 24, 31, 25 }, { 30, 11, 15, 31, 16 } },
+    },
+    { // Version 29
+        133, 6, { 6, 30, 54, 78, 102, 126 }, 3, { 14, 13, 16 }, 0b011101001100111111, 2051,
+        { 1631, 1267, 911, 701 },
+        { { 30, 7, 116, 7, 117 }, { 28, 21, 45, 7, 46 }, { 30, 1, 23, 37, 24 }, { 30, 19, 15, 26, 16 } },
+    },
+    { // Version 30
+        137, 6, { 6, 26, 52, 78, 104, 130 }, 3, { 14, 13, 16 }, 0b011110110101110101, 2185,
+        { 1735, 1373, 985, 745 },
+        { { 30, 5, 115, 10, 116 }, { 28, 19, 47, 10, 48 }, { 30, 15, 24, 25, 25 }, { 30, 23, 15, 25, 16 } },
+    },
+    { // Version 31
+        141, 6, { 6, 30, 56, 82, 108, 134 }, 3, { 14, 13, 16 }, 0b011111001001010000, 2323,
+        { 1843, 1455, 1033, 793 },
+        { { 30, 13, 115, 3, 116 }, { 28, 2, 46, 29, 47 }, { 30, 42, 24, 1, 25 }, { 30, 23, 15, 28, 16 } },
+    },
+    { // Version 32
+        145, 6, { 6, 34, 60, 86, 112, 138 }, 3, { 14, 13, 16 }, 0b100000100111010101, 2465,
+        { 1955, 1541, 1115, 845 },
+        { { 30, 17, 115, 0, 0 }, { 28, 10, 46, 23, 47 }, { 30, 10, 24, 35, 25 }, { 30, 19, 15, 35, 16 } },
+    },
+    { // Version 33
+        149, 6, { 6, 30, 58, 86, 114, 142 }, 3, { 14, 13, 16 }, 0b100001011011110000, 2611,
+        { 2071, 1631, 1171, 901 },
+        { { 30, 17, 115, 1, 116 }, { 28, 14, 46, 21, 47 }, { 30, 29, 24, 19, 25 }, { 30, 11, 15, 46, 16 } },
+    },
+    { // Version 34
+        153, 6, { 6, 34, 62, 90, 118, 146 }, 3, { 14, 13, 16 }, 0b100010100010111010, 2761,
+        { 2191, 1725, 1231, 961 },
+        { { 30, 13, 115, 6, 116 }, { 28, 14, 46, 23, 47 }, { 30, 44, 24, 7, 25 }, { 30, 59, 16, 1, 17 } },
+    },
+    { // Version 35
+        157, 7, { 6, 30, 54, 78, 102, 126, 150 }, 0, { 14, 13, 16 }, 0b100011011110011111, 2876,
+        { 2306, 1812, 1286, 986 },
+        { { 30, 12, 121, 7, 122 }, { 28, 12, 47, 26, 48 }, { 30, 39, 24, 14, 25 }, { 30, 22, 15, 41, 16 } },
+    },
+    { // Version 36
+        161, 7, { 6, 24, 50, 76, 102, 128, 154 }, 0, { 14, 13, 16 }, 0b100100101100001011, 3034,
+        { 2434, 1914, 1354, 1054 },
+        { { 30, 6, 121, 14, 122 }, { 28, 6, 47, 34, 48 }, { 30, 46, 24, 10, 25 }, { 30, 2, 15, 64, 16 } },
+    },
+    { // Version 37
+        165, 7, { 6, 28, 54, 80, 106, 132, 158 }, 0, { 14, 13, 16 }, 0b100101010000101110, 3196,
+        { 2566, 1992, 1426, 1096 },
+        { { 30, 17, 122, 4, 123 }, { 28, 29, 46, 14, 47 }, { 30, 49, 24, 10, 25 }, { 30, 24, 15, 46, 16 } },
+    },
+    { // Version 38
+        169, 7, { 6, 32, 58, 84, 110, 136, 162 }, 0, { 14, 13, 16 }, 0b100110101001100100, 3362,
+        { 2702, 2102, 1502, 1142 },
+        { { 30, 4, 122, 18, 123 }, { 28, 13, 46, 32, 47 }, { 30, 48, 24, 14, 25 }, { 30, 42, 15, 32, 16 } },
+    },
+    { // Version 39
+        173, 7, { 6, 26, 54, 82, 110, 138, 166 }, 0, { 14, 13, 16 }, 0b100111010101000001, 3532,
+        { 2812, 2216, 1582, 1222 },
+        { { 30, 20, 117, 4, 118 }, { 28, 40, 47, 7, 48 }, { 30, 43, 24, 22, 25 }, { 30, 10, 15, 67, 16 } },
+    },
+    { // Version 40
+        177, 7, { 6, 30, 58, 86, 114, 142, 170 }, 0, { 14, 13, 16 }, 0b101000110001101001, 3706,
+        { 2956, 2334, 1666, 1276 },
+        { { 30, 19, 118, 6, 119 }, { 28, 18, 47, 31, 48 }, { 30, 34, 24, 34, 25 }, { 30, 20, 15, 61, 16 } },
+    },
+};
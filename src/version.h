@@ -0,0 +1,42 @@
+#ifndef __VERSION_H__
+#define __VERSION_H__
+
+#include <stdint.h>
+
+#include "qr.h"
+
+// The block structure of a (version, error level) pair
+typedef struct {
+    uint8_t err_cnt;     // Number of error codewords for each block
+    uint8_t block_cnt_1; // Number of blocks in group 1
+    uint8_t word_cnt_1;  // Number of data codewords in each group 1 block
+    uint8_t block_cnt_2; // Number of blocks in group 2
+    uint8_t word_cnt_2;  // Number of data codewords in each group 2 block
+} BlockInfo;
+
+// Indices into VersionInfo.char_cnt_bits
+#define CHAR_CNT_NUMERIC  0
+#define CHAR_CNT_ALPHANUM 1
+#define CHAR_CNT_BYTE     2
+
+// Everything about a qr code version in one place
+// Padded to a cache line, so a lookup touches only one
+typedef struct __attribute__((aligned(64))) {
+    uint8_t side;             // Side length in modules
+    uint8_t align_cnt;        // Alignment pattern coordinates per axis
+    uint8_t align_coords[7];  // Centres of the alignment patterns (on both axes)
+    uint8_t remainder_bits;   // Data modules left over after the final message
+    uint8_t char_cnt_bits[3]; // Bits of the character count for each mode
+    uint32_t version_str;     // 18 bit version information (version 7+)
+    uint16_t total_words;     // Data and error correction codewords
+    uint16_t capacity[4];     // Data codewords for each error level
+    BlockInfo blocks[4];      // Block structure for each error level
+} VersionInfo;
+
+extern const VersionInfo version_table[40];
+
+static inline const VersionInfo* get_version_info(Version ver) {
+    return &version_table[ver - 1];
+}
+
+#endif
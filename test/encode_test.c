@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Count the allocations made by the library code below,
+// failing every one past 'malloc_limit'
+static _Atomic size_t malloc_cnt = 0;
+static _Atomic size_t malloc_limit = SIZE_MAX;
+
+static void* counted_malloc(size_t size) {
+    if (++malloc_cnt > malloc_limit)
+        return NULL;
+    return malloc(size);
+}
+
+#define malloc(size) counted_malloc(size)
+
+#include "qr.c"
+#include "qr_write.c"
+#include "module.c"
+#include "error.c"
+#include "version.c"
+#include "encode.c"
+
+#undef malloc
+
+// Encodes the same text through encode_data(), get_final_message()
+// and create_qr(), and through qr_encode_into()
+int check_encode_into(const char* text, ModeIndicator mode, Version ver, ErrorLevel lvl, MaskStrategy strategy) {
+    const size_t size = strlen(text);
+
+    Symbol sym = create_symbol(ver, lvl);
+    encode_data((const uint8_t*)text, size, mode, &sym);
+    uint8_t* final = get_final_message(sym.data, sym.data_size, ver, lvl);
+    MaskReport expected_report;
+    QrMatrix* expected = create_qr(ver, lvl, strategy, final, get_final_message_size(ver), &expected_report);
+
+    const QrBuffers buffers = qr_buffer_requirements(ver, lvl);
+    uint8_t* scratch = (uint8_t*)malloc(buffers.scratch_size + 1);
+    uint64_t* modules = (uint64_t*)malloc(buffers.modules_size);
+
+    // The scratch buffer is misaligned on purpose
+    MaskReport report;
+    size_t mallocs = malloc_cnt;
+    int success = qr_encode_into((const uint8_t*)text, size, mode, ver, lvl, strategy,
+        scratch + 1, buffers.scratch_size, modules, buffers.modules_size, &report);
+    success &= malloc_cnt == mallocs;
+
+    success &= buffers.side == expected->side && buffers.row_words == expected->row_words;
+    success &= memcmp(modules, expected->modules, buffers.modules_size) == 0;
+    success &= report.mask == expected_report.mask && report.penalty == expected_report.penalty;
+    success &= qr_get_module(modules, buffers.row_words, 8, buffers.side - 8); // The dark module
+
+    if (!success)
+        printf("Mismatch: \"%s\" version %u level %d\n", text, ver, lvl);
+
+    free(modules);
+    free(scratch);
+    free(expected);
+    free(final);
+    delete_symbol(&sym);
+
+    return success;
+}
+
+// Runs out of memory at every allocation the library makes in turn,
+// which must fail the encoding rather than crash or corrupt it
+// Each attempt lets one more table be built (they are kept), so the
+// next allocation fails until the encoding goes through
+// Has to run first, while none of the lazily built tables exist
+int test_out_of_memory() {
+    printf("test_out_of_memory()\n");
+
+    int success = 1;
+
+    const char* text = "OUT OF MEMORY";
+    const Version ver = 7;
+    const QrBuffers buffers = qr_buffer_requirements(ver, ERROR_LEVEL_QUARTILE);
+    uint8_t* scratch = (uint8_t*)malloc(buffers.scratch_size);
+    uint64_t* modules = (uint64_t*)malloc(buffers.modules_size);
+    uint64_t* expected = (uint64_t*)malloc(buffers.modules_size);
+
+    bool encoded = false;
+    for (uint32_t attempt = 0; attempt < 64 && !encoded; ++attempt) {
+        malloc_cnt = 0;
+        malloc_limit = attempt ? 1 : 0;
+        encoded = qr_encode_into((const uint8_t*)text, strlen(text), MODE_ALPHANUM, ver, ERROR_LEVEL_QUARTILE, MASK_OPTIMAL,
+            scratch, buffers.scratch_size, modules, buffers.modules_size, NULL);
+    }
+    malloc_limit = SIZE_MAX;
+    success &= encoded;
+
+    // Whatever survived the failures must still make the same qr code
+    success &= qr_encode_into((const uint8_t*)text, strlen(text), MODE_ALPHANUM, ver, ERROR_LEVEL_QUARTILE, MASK_OPTIMAL,
+        scratch, buffers.scratch_size, expected, buffers.modules_size, NULL);
+    success &= memcmp(modules, expected, buffers.modules_size) == 0;
+
+    free(expected);
+    free(modules);
+    free(scratch);
+
+    return success;
+}
+
+int test_encode_into() {
+    printf("test_encode_into()\n");
+
+    int success = 1;
+
+    success &= check_encode_into("01234567", MODE_NUMERIC, 1, ERROR_LEVEL_HIGH, MASK_OPTIMAL);
+    success &= check_encode_into("HELLO WORLD", MODE_ALPHANUM, 1, ERROR_LEVEL_QUARTILE, MASK_BOUNDED);
+    success &= check_encode_into("https://github.com/cucumberbolts/qr", MODE_BYTE, 5, ERROR_LEVEL_MEDIUM, MASK_FIXED(3));
+    success &= check_encode_into("The quick brown fox jumps over the lazy dog", MODE_BYTE, 40, ERROR_LEVEL_LOW, MASK_OPTIMAL);
+    success &= check_encode_into("https://example.com/order/31415926535897932384", MODE_AUTO, 3, ERROR_LEVEL_MEDIUM, MASK_OPTIMAL);
+
+    return success;
+}
+
+int test_buffer_requirements() {
+    printf("test_buffer_requirements()\n");
+
+    int success = 1;
+
+    const QrBuffers invalid = qr_buffer_requirements(41, ERROR_LEVEL_LOW);
+    success &= invalid.scratch_size == 0 && invalid.modules_size == 0;
+
+    const QrBuffers v1 = qr_buffer_requirements(1, ERROR_LEVEL_LOW);
+    success &= v1.side == 21 && v1.row_words == 1 && v1.modules_size == 21 * sizeof(uint64_t);
+
+    const QrBuffers v40 = qr_buffer_requirements(40, ERROR_LEVEL_LOW);
+    success &= v40.side == 177 && v40.row_words == 3 && v40.modules_size == 177 * 3 * sizeof(uint64_t);
+
+    uint64_t modules[21];
+    uint8_t scratch[64];
+    success &= !qr_encode_into((const uint8_t*)"1", 1, MODE_NUMERIC, 1, ERROR_LEVEL_LOW, MASK_OPTIMAL,
+        scratch, sizeof(scratch), modules, sizeof(modules), NULL);
+
+    // Running out of arena at any allocation fails cleanly
+    const VersionInfo* info = get_version_info(3);
+    const size_t matrices = _Alignof(QrMatrix) - 1 + 2 * sizeof(QrMatrix);
+    const size_t cutoffs[] = { 0, sizeof(QrMatrix), matrices, matrices + info->capacity[ERROR_LEVEL_MEDIUM],
+        matrices + info->capacity[ERROR_LEVEL_MEDIUM] + info->total_words };
+    const char* text = "https://example.com/order/31415926535897932384";
+    uint8_t* arena_buffer = (uint8_t*)malloc(arena_requirement(3, ERROR_LEVEL_MEDIUM));
+    for (size_t i = 0; i < sizeof(cutoffs) / sizeof(cutoffs[0]); ++i) {
+        Arena arena;
+        arena_init(&arena, arena_buffer, cutoffs[i]);
+        success &= !encode_in_arena(&arena, (const uint8_t*)text, strlen(text), MODE_AUTO, 3, ERROR_LEVEL_MEDIUM, MASK_OPTIMAL, NULL);
+    }
+    free(arena_buffer);
+
+    return success;
+}
+
+// Inputs for the encoder tests
+static const struct {
+    const char* text;
+    ModeIndicator mode;
+    Version ver;
+} encoder_inputs[] = {
+    { "01234567", MODE_NUMERIC, 1 },
+    { "HELLO WORLD", MODE_ALPHANUM, 2 },
+    { "https://github.com/cucumberbolts/qr", MODE_BYTE, 7 },
+    { "The quick brown fox jumps over the lazy dog", MODE_BYTE, 25 },
+    { "314159265358979323846264338327950288419716939937510", MODE_NUMERIC, 40 },
+    { "HTTPS://EXAMPLE.COM/ORDER/31415926535897932384", MODE_AUTO, 3 },
+};
+#define ENCODER_INPUT_CNT (sizeof(encoder_inputs) / sizeof(encoder_inputs[0]))
+
+// The qr code of every input made by qr_encode_into()
+static uint64_t* expected_codes[ENCODER_INPUT_CNT];
+
+typedef struct {
+    QrOptions options;
+    int success;
+} EncoderThread;
+
+void* encoder_thread(void* arg) {
+    EncoderThread* t = (EncoderThread*)arg;
+    QrEncoder* encoder = qr_create_encoder(t->options);
+
+    t->success = 1;
+    for (uint32_t round = 0; round < 20; ++round) {
+        for (uint32_t i = 0; i < ENCODER_INPUT_CNT; ++i) {
+            QrCode code;
+            const char* text = encoder_inputs[i].text;
+            t->success &= qr_encode(encoder, (const uint8_t*)text, strlen(text), encoder_inputs[i].mode, encoder_inputs[i].ver, &code);
+            t->success &= memcmp(code.modules, expected_codes[i], code.side * code.row_words * sizeof(uint64_t)) == 0;
+        }
+    }
+
+    qr_delete_encoder(encoder);
+    return NULL;
+}
+
+int test_encoder() {
+    printf("test_encoder()\n");
+
+    int success = 1;
+    const QrOptions options = { ERROR_LEVEL_MEDIUM, MASK_BOUNDED };
+
+    for (uint32_t i = 0; i < ENCODER_INPUT_CNT; ++i) {
+        const QrBuffers buffers = qr_buffer_requirements(encoder_inputs[i].ver, options.err_lvl);
+        void* scratch = malloc(buffers.scratch_size);
+        expected_codes[i] = (uint64_t*)malloc(buffers.modules_size);
+
+        const char* text = encoder_inputs[i].text;
+        success &= qr_encode_into((const uint8_t*)text, strlen(text), encoder_inputs[i].mode, encoder_inputs[i].ver, options.err_lvl,
+            options.strategy, scratch, buffers.scratch_size, expected_codes[i], buffers.modules_size, NULL);
+        free(scratch);
+    }
+
+    // One encoder makes every qr code without allocating
+    QrEncoder* encoder = qr_create_encoder(options);
+    size_t mallocs = malloc_cnt;
+    for (uint32_t i = 0; i < ENCODER_INPUT_CNT; ++i) {
+        QrCode code;
+        const char* text = encoder_inputs[i].text;
+        success &= qr_encode(encoder, (const uint8_t*)text, strlen(text), encoder_inputs[i].mode, encoder_inputs[i].ver, &code);
+        success &= code.side == (encoder_inputs[i].ver - 1) * 4 + 21;
+        success &= memcmp(code.modules, expected_codes[i], code.side * code.row_words * sizeof(uint64_t)) == 0;
+    }
+    success &= malloc_cnt == mallocs;
+    success &= !qr_encode(encoder, (const uint8_t*)"1", 1, MODE_NUMERIC, 41, NULL);
+    qr_delete_encoder(encoder);
+
+    // And one encoder per thread
+    pthread_t threads[4];
+    EncoderThread args[4];
+    for (uint32_t t = 0; t < 4; ++t) {
+        args[t].options = options;
+        pthread_create(&threads[t], NULL, encoder_thread, &args[t]);
+    }
+    for (uint32_t t = 0; t < 4; ++t) {
+        pthread_join(threads[t], NULL);
+        success &= args[t].success;
+    }
+
+    const QrOptions invalid = { ERROR_LEVEL_LOW, 10 };
+    success &= qr_create_encoder(invalid) == NULL;
+
+    for (uint32_t i = 0; i < ENCODER_INPUT_CNT; ++i)
+        free(expected_codes[i]);
+
+    return success;
+}
+
+int test_auto_version() {
+    printf("test_auto_version()\n");
+
+    int success = 1;
+
+    QrOptions options = { ERROR_LEVEL_MEDIUM, MASK_OPTIMAL };
+    QrEncoder* encoder = qr_create_encoder(options);
+
+    // The smallest version is the same as asking for it
+    for (uint32_t i = 0; i < ENCODER_INPUT_CNT; ++i) {
+        const char* text = encoder_inputs[i].text;
+        const size_t size = strlen(text);
+        const Version ver = qr_min_version((const uint8_t*)text, size, encoder_inputs[i].mode, options.err_lvl);
+
+        QrCode code;
+        success &= qr_encode(encoder, (const uint8_t*)text, size, encoder_inputs[i].mode, VERSION_AUTO, &code);
+        success &= ver != VERSION_AUTO && code.version == ver && code.side == (ver - 1) * 4 + 21;
+
+        const QrBuffers buffers = qr_buffer_requirements(ver, options.err_lvl);
+        uint8_t* scratch = (uint8_t*)malloc(buffers.scratch_size);
+        uint64_t* modules = (uint64_t*)malloc(buffers.modules_size);
+        success &= qr_encode_into((const uint8_t*)text, size, encoder_inputs[i].mode, ver, options.err_lvl, options.strategy,
+            scratch, buffers.scratch_size, modules, buffers.modules_size, NULL);
+        success &= memcmp(code.modules, modules, buffers.modules_size) == 0;
+        free(modules);
+        free(scratch);
+    }
+
+    // Too much data for any version (and for the version asked for)
+    static uint8_t data[2400];
+    memset(data, 'x', sizeof(data));
+    QrCode code;
+    success &= qr_min_version(data, sizeof(data), MODE_BYTE, options.err_lvl) == VERSION_AUTO;
+    success &= !qr_encode(encoder, data, sizeof(data), MODE_BYTE, VERSION_AUTO, &code);
+    success &= !qr_encode(encoder, data, 100, MODE_BYTE, 3, &code);
+
+    qr_delete_encoder(encoder);
+
+    return success;
+}
+
+int main() {
+    int success = 1;
+    success &= test_out_of_memory();
+    success &= test_encode_into();
+    success &= test_buffer_requirements();
+    success &= test_encoder();
+    success &= test_auto_version();
+
+    if (success) {
+        printf("ALL TESTS COMPLETED SUCCESSFULLY!\n");
+        exit(EXIT_SUCCESS);
+    } else {
+        printf("TEST FAILED!\n");
+        exit(EXIT_FAILURE);
+    }
+}
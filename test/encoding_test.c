@@ -1,5 +1,6 @@
 #include "qr.c"
 #include "qr_write.c"
+#include "version.c"
 
 /* Print bytes in binary */
 void print_bits(uint8_t* data, size_t size) {
@@ -72,6 +73,82 @@ int test_numeric_encode() {
     return success;
 }
 
+// Writes 'count' bits of 'bits' at bit 'index', one at a time
+size_t put_bits_slow(uint8_t* data, size_t index, uint32_t bits, uint32_t count) {
+    for (uint32_t b = count; b-- > 0; ++index)
+        data[index / 8] |= (bits >> b & 1) << (7 - index % 8);
+    return index;
+}
+
+// Numeric mode codewords worked out a bit at a time
+void numeric_reference(const char* digits, size_t size, Version ver, ErrorLevel lvl, uint8_t* expected) {
+    const size_t codeword_cnt = codeword_capacity(ver, lvl);
+    memset(expected, 0, codeword_cnt);
+
+    size_t index = put_bits_slow(expected, 0, MODE_NUMERIC, 4);
+    index = put_bits_slow(expected, index, size, get_version_info(ver)->char_cnt_bits[CHAR_CNT_NUMERIC]);
+    for (size_t i = 0; i < size; i += 3) {
+        const size_t left = size - i < 3 ? size - i : 3;
+        uint32_t group = 0;
+        for (size_t k = 0; k < left; ++k)
+            group = group * 10 + digits[i + k] - '0';
+        index = put_bits_slow(expected, index, group, left == 3 ? 10 : left == 2 ? 7 : 4);
+    }
+
+    // The terminator and the pad codewords
+    index = (index + 4 + 7) / 8;
+    for (size_t i = 0; index < codeword_cnt; ++i)
+        expected[index++] = i % 2 ? 0b00010001 : 0b11101100;
+}
+
+int test_numeric_blocks() {
+    printf("test_numeric_blocks()\n");
+
+    int success = 1;
+
+    // The reference gives the test_numeric_encode() vectors
+    {
+        uint8_t expected[9];
+        const uint8_t vector[9] = {
+            0b00010000, 0b01000000,
+            0b00001100, 0b01010110,
+            0b01101010, 0b01101110,
+            0b00010100, 0b11101010,
+            0b01010000,
+        };
+        numeric_reference("0123456789012345", 16, 1, ERROR_LEVEL_HIGH, expected);
+        success &= memcmp(expected, vector, sizeof(vector)) == 0;
+    }
+
+    // Long numbers go 24 and 48 digits at a time, then the rest
+    // one group at a time: every length up to a few blocks, and the most
+    static char digits[7089];
+    static uint8_t expected[2956];
+    for (size_t i = 0; i < sizeof(digits); ++i)
+        digits[i] = '0' + (i * 7 + i / 10) % 10;
+
+    Symbol sym = create_symbol(40, ERROR_LEVEL_LOW);
+
+    for (size_t n = 0; n <= 151; ++n) {
+        const size_t size = n <= 150 ? n : 7089;
+        numeric_reference(digits, size, 40, ERROR_LEVEL_LOW, expected);
+        success &= encode_data(digits, size, MODE_NUMERIC, &sym);
+        success &= memcmp(expected, sym.data, sym.data_size) == 0;
+    }
+
+    // A character that isn't a digit, in a block and in the rest
+    const size_t bad_at[3] = { 30, 100, 7088 };
+    for (int b = 0; b < 3; ++b) {
+        digits[bad_at[b]] = b % 2 ? '/' : ':';
+        success &= !encode_data(digits, 7089, MODE_NUMERIC, &sym);
+        digits[bad_at[b]] = '0';
+    }
+
+    delete_symbol(&sym);
+
+    return success;
+}
+
 int test_alphanumeric_encode() {
     printf("test_alpha_numeric_encode()\n");
 
@@ -142,11 +219,237 @@ int test_byte_encode() {
     return success;
 }
 
+int test_char_classes() {
+    printf("test_char_classes()\n");
+
+    int success = 1;
+
+    const char* alphanum = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+
+    // Every byte, starting at every offset into a vector
+    uint8_t bytes[256 + 32];
+    uint8_t classes[256 + 32];
+    for (size_t offset = 0; offset < 32; ++offset) {
+        for (size_t b = 0; b < 256; ++b)
+            bytes[offset + b] = b;
+        classify_chars(bytes, offset + 256, classes);
+
+        for (size_t b = 0; b < 256; ++b) {
+            const char* found = b ? strchr(alphanum, b) : NULL;
+            uint8_t expected = !found ? CHAR_BYTE : found - alphanum < 10 ? CHAR_NUMERIC : CHAR_ALPHANUM;
+            success &= classes[offset + b] == expected;
+            success &= encode_alphanumeric(b) == (found ? found - alphanum : ALPHANUM_INVALID);
+        }
+    }
+
+    // The first character a mode can't encode, in any chunk
+    static uint8_t text[1000];
+    memset(text, 'A', sizeof(text));
+    success &= find_invalid_char(text, sizeof(text), MODE_ALPHANUM) == sizeof(text);
+    success &= find_invalid_char(text, sizeof(text), MODE_NUMERIC) == 0;
+    success &= find_invalid_char(text, sizeof(text), MODE_BYTE) == sizeof(text);
+
+    const size_t invalid_at[4] = { 0, 17, 300, 999 };
+    for (int i = 0; i < 4; ++i) {
+        text[invalid_at[i]] = 'a';
+        success &= find_invalid_char(text, sizeof(text), MODE_ALPHANUM) == invalid_at[i];
+        text[invalid_at[i]] = 'A';
+    }
+
+    // Lower case letters are rejected rather than encoded as 45
+    Symbol sym = create_symbol(2, ERROR_LEVEL_LOW);
+    success &= !encode_data("Hello", 5, MODE_ALPHANUM, &sym);
+    success &= sym.data_size == 0;
+    success &= encode_data("HELLO", 5, MODE_ALPHANUM, &sym);
+    delete_symbol(&sym);
+
+    return success;
+}
+
+// The bits of the segments 'modes' splits the data into,
+// one segment per run of the same mode
+static size_t segmentation_bits(const uint8_t* modes, size_t size, Version version) {
+    size_t bits = 0;
+    for (size_t start = 0, end = 0; start < size; start = end) {
+        while (end < size && modes[end] == modes[start])
+            ++end;
+        bits += segment_bits(end - start, modes[start], version);
+    }
+    return bits;
+}
+
+// The fewest bits of any segmentation, trying every mode for every character
+static size_t exhaustive_segment_bits(const uint8_t* data, size_t size, Version version) {
+    const ModeIndicator all_modes[3] = { MODE_NUMERIC, MODE_ALPHANUM, MODE_BYTE };
+    const uint8_t needs[3] = { CHAR_NUMERIC, CHAR_ALPHANUM, CHAR_BYTE };
+
+    size_t combinations = 1;
+    for (size_t i = 0; i < size; ++i)
+        combinations *= 3;
+
+    size_t best = SIZE_MAX;
+    for (size_t c = 0; c < combinations; ++c) {
+        uint8_t modes[8];
+        bool fits = true;
+        for (size_t i = 0, rest = c; i < size; ++i, rest /= 3) {
+            modes[i] = all_modes[rest % 3];
+            fits &= char_class(data[i]) >= needs[rest % 3];
+        }
+
+        size_t bits = segmentation_bits(modes, size, version);
+        if (fits && bits < best)
+            best = bits;
+    }
+
+    return best;
+}
+
+int test_segment_encode() {
+    printf("test_segment_encode()\n");
+
+    int success = 1;
+
+    Symbol sym = create_symbol(1, ERROR_LEVEL_HIGH);
+
+    {
+        // Too long for byte mode (76 bits), but a byte segment
+        // and a numeric segment fit (58 bits)
+        const char* str = "a1234567";
+        uint8_t expected[] = {
+            0b01000000, 0b00010110,
+            0b00010001, 0b00000001,
+            0b11000111, 0b10110111,
+            0b00100001, 0b11000000,
+            // Pad codeword
+            0b11101100,
+        };
+
+        uint8_t modes[8];
+        success &= choose_segments(str, strlen(str), 1, modes) == 58;
+        success &= modes[0] == MODE_BYTE;
+        for (int i = 1; i < 8; ++i)
+            success &= modes[i] == MODE_NUMERIC;
+
+        encode_data(str, strlen(str), MODE_AUTO, &sym);
+
+        printf("Expected:\n");
+        print_bits(expected, sizeof(expected));
+
+        printf("Result:\n");
+        print_bits(sym.data, sym.data_size);
+
+        success &= memcmp(expected, sym.data, sym.data_size) == 0;
+        success &= sym.data_size == sizeof(expected);
+    }
+
+    {
+        // A single mode is kept when switching doesn't pay off
+        const char* strs[3] = { "0123456789012345", "AC-42 HELLO", "https://github.com/cucumberbolts/qr" };
+        const ModeIndicator single[3] = { MODE_NUMERIC, MODE_ALPHANUM, MODE_BYTE };
+
+        for (int s = 0; s < 3; ++s) {
+            uint8_t modes[64];
+            size_t size = strlen(strs[s]);
+            success &= choose_segments(strs[s], size, 10, modes) == segment_bits(size, single[s], 10);
+            for (size_t i = 0; i < size; ++i)
+                success &= modes[i] == single[s];
+        }
+    }
+
+    {
+        // Order IDs in a URL: the digits get their own segment
+        const char* str = "HTTPS://EXAMPLE.COM/ORDER/31415926535897932384";
+        uint8_t modes[64];
+        size_t size = strlen(str);
+        size_t bits = choose_segments(str, size, 1, modes);
+
+        success &= bits == segment_bits(26, MODE_ALPHANUM, 1) + segment_bits(20, MODE_NUMERIC, 1);
+        success &= bits < segment_bits(size, MODE_ALPHANUM, 1);
+        for (size_t i = 0; i < size; ++i)
+            success &= modes[i] == (i < 26 ? MODE_ALPHANUM : MODE_NUMERIC);
+    }
+
+    {
+        // Short random mixed inputs match an exhaustive search, at
+        // every character count width
+        const char alphabet[] = "0123456789AZ $%*+-./:az#";
+        const Version versions[3] = { 1, 10, 27 };
+        uint32_t seed = 2718;
+
+        for (int v = 0; v < 3; ++v) {
+            for (int round = 0; round < 200; ++round) {
+                uint8_t data[8];
+                uint8_t modes[8];
+                size_t size = 1 + round % 8;
+                for (size_t i = 0; i < size; ++i) {
+                    seed = seed * 1103515245 + 12345;
+                    data[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+                }
+
+                size_t bits = choose_segments(data, size, versions[v], modes);
+                success &= bits == exhaustive_segment_bits(data, size, versions[v]);
+                success &= bits == segmentation_bits(modes, size, versions[v]);
+            }
+        }
+    }
+
+    delete_symbol(&sym);
+
+    return success;
+}
+
+int test_version_selection() {
+    printf("test_version_selection()\n");
+
+    int success = 1;
+
+    static uint8_t data[7089];
+    memset(data, '7', sizeof(data));
+
+    // Byte mode at level L: version 1 holds 17 bytes, version 9 holds
+    // 230 and version 10 (with a 16-bit character count) 271
+    success &= choose_version(data, 17, MODE_BYTE, ERROR_LEVEL_LOW) == 1;
+    success &= choose_version(data, 18, MODE_BYTE, ERROR_LEVEL_LOW) == 2;
+    success &= choose_version(data, 230, MODE_BYTE, ERROR_LEVEL_LOW) == 9;
+    success &= choose_version(data, 231, MODE_BYTE, ERROR_LEVEL_LOW) == 10;
+    success &= choose_version(data, 2953, MODE_BYTE, ERROR_LEVEL_LOW) == 40;
+    success &= choose_version(data, 2954, MODE_BYTE, ERROR_LEVEL_LOW) == 0;
+
+    // The most digits any qr code holds
+    success &= choose_version(data, 7089, MODE_NUMERIC, ERROR_LEVEL_LOW) == 40;
+    success &= choose_version(data, 7089, MODE_AUTO, ERROR_LEVEL_LOW) == 40;
+    success &= choose_version(data, 7089, MODE_NUMERIC, ERROR_LEVEL_MEDIUM) == 0;
+
+    // The segments fit a smaller version than byte mode does
+    const char* str = "a1234567";
+    success &= choose_version(str, strlen(str), MODE_BYTE, ERROR_LEVEL_HIGH) == 2;
+    success &= choose_version(str, strlen(str), MODE_AUTO, ERROR_LEVEL_HIGH) == 1;
+
+    Symbol sym = create_symbol(VERSION_AUTO, ERROR_LEVEL_HIGH);
+    success &= encode_data(str, strlen(str), MODE_AUTO, &sym);
+    success &= sym.version == 1 && sym.data_size == 9;
+    delete_symbol(&sym);
+
+    // Too much data is an error rather than cut off
+    sym = create_symbol(1, ERROR_LEVEL_HIGH);
+    success &= !encode_data(str, strlen(str), MODE_BYTE, &sym);
+    success &= sym.data_size == 0;
+    sym = create_symbol(VERSION_AUTO, ERROR_LEVEL_LOW);
+    success &= !encode_data(data, 2954, MODE_BYTE, &sym);
+    success &= sym.data_size == 0;
+
+    return success;
+}
+
 int main() {
     int success = 1;
     success &= test_numeric_encode();
+    success &= test_numeric_blocks();
     success &= test_alphanumeric_encode();
     success &= test_byte_encode();
+    success &= test_char_classes();
+    success &= test_segment_encode();
+    success &= test_version_selection();
     if (success) {
         printf("ALL TESTS COMPLETED SUCCESSFULLY!\n");
         exit(EXIT_SUCCESS);
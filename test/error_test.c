@@ -2,6 +2,49 @@
 
 #include "error.c"
 
+int test_generated_tables() {
+    printf("test_generated_tables()\n");
+
+    int success = 1;
+
+    // The field is generated by p(x) = x^8 + x^4 + x^3 + x^2 + 1
+    uint8_t a = 1;
+    for (int i = 0; i < 255; ++i) {
+        success &= ff_exp[i] == a;
+        success &= ff_log[a] == i;
+        a = (a << 1) ^ ((a & 0x80) ? 0b00011101 : 0);
+    }
+
+    // The generator of degree n is (x - a^0)(x - a^1)...(x - a^(n-1))
+    uint8_t gen[MAX_GEN_DEG + 1] = { 1 };
+    for (uint32_t deg = 1; deg <= MAX_GEN_DEG; ++deg) {
+        // Multiply by (x - a^(deg-1))
+        for (uint32_t i = deg; i > 0; --i)
+            gen[i] ^= ff_multiply(gen[i - 1], ff_exp[deg - 1]);
+
+        const uint8_t* expected = get_generator(deg);
+        for (uint32_t i = 0; i <= deg; ++i)
+            success &= ff_exp[expected[i]] == gen[i];
+    }
+
+    // The product tables hold the generator times every feedback value
+    for (uint32_t slot = 0; slot < EC_COUNT_CNT; ++slot) {
+        uint32_t deg = ec_word_counts[slot];
+        const uint8_t* g = get_generator(deg);
+        success &= gen_table_slots[deg] == (int8_t)slot;
+
+        for (uint32_t f = 0; f < 256; ++f) {
+            for (uint32_t j = 0; j < 8 * RS_WORDS; ++j) {
+                uint8_t term = gen_tables[slot][f][j / 8] >> (8 * (j % 8));
+                uint8_t expected = j < deg ? ff_multiply(f, ff_exp[g[j + 1]]) : 0;
+                success &= term == expected;
+            }
+        }
+    }
+
+    return success;
+}
+
 int test_generator_generation() {
     printf("test_generator_generation()\n");
 
@@ -47,13 +90,104 @@ int test_hello_world_error() {
     return success;
 }
 
-int main() {
-    init_finite_field();
-    init_generators();
+int test_shift_register_encoder() {
+    printf("test_shift_register_encoder()\n");
 
     int success = 1;
+
+    // Compare against polynomial division for
+    // every codeword count and block size in use
+    uint32_t seed = 12345;
+    for (uint32_t c = 0; c < EC_COUNT_CNT; ++c) {
+        uint32_t ec_cnt = ec_word_counts[c];
+
+        for (uint32_t len = 1; len <= 123; ++len) {
+            uint8_t msg[123];
+            for (uint32_t i = 0; i < len; ++i) {
+                seed = seed * 1103515245 + 12345;
+                msg[i] = seed >> 16;
+            }
+
+            // Exercise zero coefficients as well
+            if (len > 2)
+                msg[len / 2] = 0;
+
+            uint8_t expected[MAX_EC_WORDS];
+            uint8_t result[MAX_EC_WORDS];
+            poly_div(msg, get_generator(ec_cnt), len - 1, ec_cnt, ec_cnt, expected);
+            get_error_codewords(msg, len, result, ec_cnt);
+
+            if (memcmp(expected, result, ec_cnt) != 0) {
+                printf("Mismatch: %u error codewords, %u message codewords\n", ec_cnt, len);
+                success = 0;
+            }
+
+            // The scalar fallback must agree as well
+            rs_encode_scalar(gen_tables[c], msg, len, result, 1, ec_cnt);
+            success &= memcmp(expected, result, ec_cnt) == 0;
+        }
+    }
+
+    return success;
+}
+
+int test_batch_encoder() {
+    printf("test_batch_encoder()\n");
+
+    int success = 1;
+    uint32_t seed = 6789;
+
+    for (uint32_t c = 0; c < EC_COUNT_CNT; ++c) {
+        uint32_t ec_cnt = ec_word_counts[c];
+        uint32_t len = 1 + (c * 37) % 123;
+
+        uint8_t msg_soa[123 * RS_BATCH];
+        for (uint32_t i = 0; i < len * RS_BATCH; ++i) {
+            seed = seed * 1103515245 + 12345;
+            msg_soa[i] = seed >> 16;
+        }
+
+        uint8_t ec_soa[MAX_EC_WORDS * RS_BATCH];
+        get_error_codewords_batch(msg_soa, len, ec_soa, ec_cnt);
+
+        uint8_t scalar_soa[MAX_EC_WORDS * RS_BATCH];
+        rs_encode_batch_scalar(gen_tables[c], msg_soa, len, scalar_soa, ec_cnt);
+
+#ifdef __SSE2__
+        // The dispatcher prefers AVX2, so call the SSSE3 kernel directly
+        if (__builtin_cpu_supports("ssse3")) {
+            uint8_t ssse3_soa[MAX_EC_WORDS * RS_BATCH];
+            rs_encode_batch_ssse3(get_generator(ec_cnt) + 1, msg_soa, len, ssse3_soa, ec_cnt);
+            success &= memcmp(ssse3_soa, scalar_soa, ec_cnt * RS_BATCH) == 0;
+        }
+#endif
+
+        // Every lane must match the single message encoder
+        for (uint32_t lane = 0; lane < RS_BATCH; ++lane) {
+            uint8_t msg[123];
+            for (uint32_t i = 0; i < len; ++i)
+                msg[i] = msg_soa[i * RS_BATCH + lane];
+
+            uint8_t expected[MAX_EC_WORDS];
+            get_error_codewords(msg, len, expected, ec_cnt);
+
+            for (uint32_t j = 0; j < ec_cnt; ++j) {
+                success &= ec_soa[j * RS_BATCH + lane] == expected[j];
+                success &= scalar_soa[j * RS_BATCH + lane] == expected[j];
+            }
+        }
+    }
+
+    return success;
+}
+
+int main() {
+    int success = 1;
+    success &= test_generated_tables();
     success &= test_generator_generation();
     success &= test_hello_world_error();
+    success &= test_shift_register_encoder();
+    success &= test_batch_encoder();
     if (success) {
         printf("ALL TESTS COMPLETED SUCCESSFULLY!\n");
         exit(EXIT_SUCCESS);
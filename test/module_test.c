@@ -1,48 +1,804 @@
 #include "module.c"
 
 #include "error.c"
+#include "version.c"
 
-int test_word_generation() {
-    uint8_t msg[] = {
-        0b01000011, 0b01010101, 0b01000110, 0b10000110, 0b01010111, 0b00100110,
-        0b01010101, 0b11000010, 0b01110111, 0b00110010, 0b00000110, 0b00010010,
-        0b00000110, 0b01100111, 0b00100110, 0b11110110, 0b11110110, 0b01000010,
-        0b00000111, 0b01110110, 0b10000110, 0b11110010, 0b00000111, 0b00100110,
-        0b01010110, 0b00010110, 0b11000110, 0b11000111, 0b10010010, 0b00000110,
-        0b10110110, 0b11100110, 0b11110111, 0b01110111, 0b00110010, 0b00000111,
-        0b01110110, 0b10000110, 0b01010111, 0b00100110, 0b01010010, 0b00000110,
-        0b10000110, 0b10010111, 0b00110010, 0b00000111, 0b01000110, 0b11110111,
-        0b01110110, 0b01010110, 0b11000010, 0b00000110, 0b10010111, 0b00110010,
-        0b11100000, 0b11101100, 0b00010001, 0b11101100, 0b00010001, 0b11101100,
-        0b00010001, 0b11101100,
-    };
+// Version 5-Q message from the thonky.com tutorial
+static uint8_t word_gen_msg[] = {
+    0b01000011, 0b01010101, 0b01000110, 0b10000110, 0b01010111, 0b00100110,
+    0b01010101, 0b11000010, 0b01110111, 0b00110010, 0b00000110, 0b00010010,
+    0b00000110, 0b01100111, 0b00100110, 0b11110110, 0b11110110, 0b01000010,
+    0b00000111, 0b01110110, 0b10000110, 0b11110010, 0b00000111, 0b00100110,
+    0b01010110, 0b00010110, 0b11000110, 0b11000111, 0b10010010, 0b00000110,
+    0b10110110, 0b11100110, 0b11110111, 0b01110111, 0b00110010, 0b00000111,
+    0b01110110, 0b10000110, 0b01010111, 0b00100110, 0b01010010, 0b00000110,
+    0b10000110, 0b10010111, 0b00110010, 0b00000111, 0b01000110, 0b11110111,
+    0b01110110, 0b01010110, 0b11000010, 0b00000110, 0b10010111, 0b00110010,
+    0b11100000, 0b11101100, 0b00010001, 0b11101100, 0b00010001, 0b11101100,
+    0b00010001, 0b11101100,
+};
 
+// Its interleaved data and error correction codewords
+static const uint8_t word_gen_expected[] = {
+    // Message codewords
+    67, 246, 182, 70, 85, 246, 230, 247, 70, 66, 247, 118, 134, 7, 119,
+    86, 87, 118, 50, 194, 38, 134, 7, 6, 85, 242, 118, 151, 194, 7,
+    134, 50, 119, 38, 87, 224, 50, 86, 38, 236, 6, 22, 82, 17, 18, 198,
+    6, 236, 6, 199, 134, 17, 103, 146, 151, 236, 38, 6, 50, 17, 7, 236,
+
+    // Error correction codewords
+    213, 87, 148, 140, 199, 204, 116, 100, 11,
+    96, 177, 250, 45, 60, 212, 247, 115, 202,
+    76, 108, 247, 182, 133, 131, 241, 124, 75,
+    37, 223, 157, 242, 104, 229, 200, 238, 253,
+    248, 134, 76, 113, 154, 27, 195, 111, 117,
+    129, 230, 235, 154, 209, 189, 197, 111, 17,
+    10, 83, 86, 163, 108, 6, 161, 163, 240,
+    205, 111, 120, 192, 89, 39, 133, 141, 74,
+};
+
+int test_word_generation() {
     Version ver = 5;
     ErrorLevel lvl = ERROR_LEVEL_QUARTILE;
 
-    uint8_t expected[] = {
-        // Message codewords
-        67, 246, 182, 70, 85, 246, 230, 247, 70, 66, 247, 118, 134, 7, 119,
-        86, 87, 118, 50, 194, 38, 134, 7, 6, 85, 242, 118, 151, 194, 7,
-        134, 50, 119, 38, 87, 224, 50, 86, 38, 236, 6, 22, 82, 17, 18, 198,
-        6, 236, 6, 199, 134, 17, 103, 146, 151, 236, 38, 6, 50, 17, 7, 236,
+    uint8_t* final = get_final_message(word_gen_msg, sizeof(word_gen_msg), ver, lvl);
 
-        // Error correction codewords
-        213, 87, 148, 140, 199, 204, 116, 100, 11,
-        96, 177, 250, 45, 60, 212, 247, 115, 202,
-        76, 108, 247, 182, 133, 131, 241, 124, 75,
-        37, 223, 157, 242, 104, 229, 200, 238, 253,
-        248, 134, 76, 113, 154, 27, 195, 111, 117,
-        129, 230, 235, 154, 209, 189, 197, 111, 17,
-        10, 83, 86, 163, 108, 6, 161, 163, 240,
-        205, 111, 120, 192, 89, 39, 133, 141, 74,
-    };
+    int success = memcmp(final, word_gen_expected, sizeof(word_gen_expected)) == 0;
 
-    uint8_t* final = get_final_message(msg, sizeof(msg), ver, lvl);
+    free(final);
+
+    return success;
+}
 
-    int success = memcmp(final, expected, sizeof(expected)) == 0;
+int test_word_generation_kernels() {
+    printf("test_word_generation_kernels()\n");
 
-    free(final);
+    // Version 5-Q: 2 blocks of 15 and 2 blocks of 16
+    // data codewords, 18 error correction codewords each
+    const uint32_t block_sizes[] = { 15, 15, 16, 16 };
+    const uint32_t block_cnt = 4;
+    const uint32_t err_cnt = 18;
+    GenTable table = gen_tables[gen_table_slots[err_cnt]];
+
+    int success = 1;
+    size_t msg_offset = 0;
+    for (uint32_t b = 0; b < block_cnt; ++b) {
+        // De-interleave the expected error correction codewords
+        uint8_t expected[18];
+        for (uint32_t i = 0; i < err_cnt; ++i)
+            expected[i] = word_gen_expected[sizeof(word_gen_msg) + i * block_cnt + b];
+
+        uint8_t result[18];
+        rs_encode_scalar(table, word_gen_msg + msg_offset, block_sizes[b], result, 1, err_cnt);
+        success &= memcmp(expected, result, err_cnt) == 0;
+
+#ifdef __SSE2__
+        memset(result, 0, sizeof(result));
+        rs_encode_sse2(table, word_gen_msg + msg_offset, block_sizes[b], result, 1, err_cnt);
+        success &= memcmp(expected, result, err_cnt) == 0;
+#endif
+
+        msg_offset += block_sizes[b];
+    }
+
+    return success;
+}
+
+int test_final_message_layout() {
+    printf("test_final_message_layout()\n");
+
+    int success = 1;
+    uint32_t seed = 1;
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        for (ErrorLevel lvl = ERROR_LEVEL_LOW; lvl <= ERROR_LEVEL_HIGH; ++lvl) {
+            const BlockInfo info = get_block_info(ver, lvl);
+            const uint32_t block_cnt = info.block_cnt_1 + info.block_cnt_2;
+            const size_t msg_len = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+            const size_t final_size = get_final_message_size(ver);
+
+            uint8_t* msg = (uint8_t*)malloc(msg_len);
+            for (size_t i = 0; i < msg_len; ++i) {
+                seed = seed * 1103515245 + 12345;
+                msg[i] = seed >> 16;
+            }
+
+            // Reference layout: take codeword i from every block
+            // in turn, skipping blocks that are too short
+            uint8_t* expected = (uint8_t*)malloc(final_size);
+            size_t pos = 0;
+            for (uint32_t i = 0; i < info.word_cnt_2 || i < info.word_cnt_1; ++i) {
+                size_t offset = 0;
+                for (uint32_t b = 0; b < block_cnt; ++b) {
+                    uint32_t len = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+                    if (i < len)
+                        expected[pos++] = msg[offset + i];
+                    offset += len;
+                }
+            }
+
+            uint8_t err_words[MAX_EC_WORDS];
+            size_t offset = 0;
+            for (uint32_t b = 0; b < block_cnt; ++b) {
+                uint32_t len = b < info.block_cnt_1 ? info.word_cnt_1 : info.word_cnt_2;
+                get_error_codewords(msg + offset, len, err_words, info.err_cnt);
+                for (uint32_t i = 0; i < info.err_cnt; ++i)
+                    expected[msg_len + i * block_cnt + b] = err_words[i];
+                offset += len;
+            }
+
+            uint8_t* final = get_final_message(msg, msg_len, ver, lvl);
+            if (!final || memcmp(final, expected, final_size) != 0) {
+                printf("Mismatch: version %u level %d\n", ver, lvl);
+                success = 0;
+            }
+
+            free(final);
+            free(expected);
+            free(msg);
+        }
+    }
+
+    return success;
+}
+
+int test_batch_final_message() {
+    printf("test_batch_final_message()\n");
+
+    int success = 1;
+    uint32_t seed = 3;
+
+    // Not a multiple of RS_BATCH, so the last batch is partial
+    const size_t count = RS_BATCH + 5;
+    uint8_t* msgs[RS_BATCH + 5];
+    uint8_t* finals[RS_BATCH + 5];
+
+    const Version versions[] = { 1, 5, 22, 40 };
+    for (uint32_t v = 0; v < 4; ++v) {
+        Version ver = versions[v];
+        ErrorLevel lvl = v % 4;
+
+        const BlockInfo info = get_block_info(ver, lvl);
+        const size_t msg_len = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+        const size_t final_size = get_final_message_size(ver);
+
+        for (size_t m = 0; m < count; ++m) {
+            msgs[m] = (uint8_t*)malloc(msg_len);
+            finals[m] = (uint8_t*)malloc(final_size);
+            for (size_t i = 0; i < msg_len; ++i) {
+                seed = seed * 1103515245 + 12345;
+                msgs[m][i] = seed >> 16;
+            }
+        }
+
+        success &= get_final_messages_batch((const uint8_t* const*)msgs, msg_len, ver, lvl, finals, count);
+
+        for (size_t m = 0; m < count; ++m) {
+            uint8_t* expected = get_final_message(msgs[m], msg_len, ver, lvl);
+            success &= memcmp(finals[m], expected, final_size) == 0;
+            free(expected);
+            free(finals[m]);
+            free(msgs[m]);
+        }
+    }
+
+    return success;
+}
+
+int test_message_prefix() {
+    printf("test_message_prefix()\n");
+
+    int success = 1;
+    uint32_t seed = 4;
+
+    const Version versions[] = { 1, 7, 25, 40 };
+    for (uint32_t v = 0; v < 4; ++v) {
+        Version ver = versions[v];
+        ErrorLevel lvl = (v + 1) % 4;
+
+        const BlockInfo info = get_block_info(ver, lvl);
+        const size_t msg_len = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+        const size_t final_size = get_final_message_size(ver);
+
+        uint8_t* msg = (uint8_t*)malloc(msg_len);
+        uint8_t* final = (uint8_t*)malloc(final_size);
+
+        // Prefixes that end inside a block, on a block
+        // boundary, and cover nothing or everything
+        const size_t prefix_lens[] = { 0, 3, info.word_cnt_1, msg_len / 2 + 1, msg_len };
+        for (uint32_t p = 0; p < 5; ++p) {
+            for (size_t i = 0; i < msg_len; ++i) {
+                seed = seed * 1103515245 + 12345;
+                msg[i] = seed >> 16;
+            }
+
+            MessagePrefix prefix;
+            success &= init_message_prefix(&prefix, msg, prefix_lens[p], ver, lvl);
+
+            // Several suffixes share the prefix
+            for (uint32_t r = 0; r < 3; ++r) {
+                for (size_t i = prefix_lens[p]; i < msg_len; ++i) {
+                    seed = seed * 1103515245 + 12345;
+                    msg[i] = seed >> 16;
+                }
+
+                uint8_t* expected = get_final_message(msg, msg_len, ver, lvl);
+                success &= get_final_message_resume(&prefix, msg, msg_len, final);
+                success &= memcmp(final, expected, final_size) == 0;
+                free(expected);
+            }
+        }
+
+        free(final);
+        free(msg);
+    }
+
+    return success;
+}
+
+// The tables version_table replaced, as they were before it
+// Alignment pattern centres of versions 2 - 40, 7 per version
+static const uint8_t old_align_pat_coords[] = {
+    6, 18, 0,  0,  0, 0, 0,
+    6, 22, 0,  0,  0, 0, 0,
+    6, 26, 0,  0,  0, 0, 0,
+    6, 30, 0,  0,  0, 0, 0,
+    6, 34, 0,  0,  0, 0, 0,
+    6, 22, 38, 0,  0, 0, 0,
+    6, 24, 42, 0,  0, 0, 0,
+    6, 26, 46, 0,  0, 0, 0,
+    6, 28, 50, 0,  0, 0, 0,
+    6, 30, 54, 0,  0, 0, 0,
+    6, 32, 58, 0,  0, 0, 0,
+    6, 34, 62, 0,  0, 0, 0,
+    6, 26, 46, 66, 0, 0, 0,
+    6, 26, 48, 70, 0, 0, 0,
+    6, 26, 50, 74, 0, 0, 0,
+    6, 30, 54, 78, 0, 0, 0,
+    6, 30, 56, 82, 0, 0, 0,
+    6, 30, 58, 86, 0, 0, 0,
+    6, 34, 62, 90, 0, 0, 0,
+    6, 28, 50, 72, 94, 0, 0,
+    6, 26, 50, 74, 98, 0, 0,
+    6, 30, 54, 78, 102, 0, 0,
+    6, 28, 54, 80, 106, 0, 0,
+    6, 32, 58, 84, 110, 0, 0,
+    6, 30, 58, 86, 114, 0, 0,
+    6, 34, 62, 90, 118, 0, 0,
+    6, 26, 50, 74, 98,  122, 0,
+    6, 30, 54, 78, 102, 126, 0,
+    6, 26, 52, 78, 104, 130, 0,
+    6, 30, 56, 82, 108, 134, 0,
+    6, 34, 60, 86, 112, 138, 0,
+    6, 30, 58, 86, 114, 142, 0,
+    6, 34, 62, 90, 118, 146, 0,
+    6, 30, 54, 78, 102, 126, 150,
+    6, 24, 50, 76, 102, 128, 154,
+    6, 28, 54, 80, 106, 132, 158,
+    6, 32, 58, 84, 110, 136, 162,
+    6, 26, 54, 82, 110, 138, 166,
+    6, 30, 58, 86, 114, 142, 170,
+};
+
+// Error correction codewords per block, then the blocks and data
+// codewords of groups 1 and 2, for each version and error level
+static const uint8_t old_error_table[] = {
+    7, 1, 19, 0, 0, 10, 1, 16, 0, 0, 13, 1, 13, 0, 0,
+    17, 1, 9, 0, 0, 10, 1, 34, 0, 0, 16, 1, 28, 0, 0,
+    22, 1, 22, 0, 0, 28, 1, 16, 0, 0, 15, 1, 55, 0, 0,
+    26, 1, 44, 0, 0, 18, 2, 17, 0, 0, 22, 2, 13, 0, 0,
+    20, 1, 80, 0, 0, 18, 2, 32, 0, 0, 26, 2, 24, 0, 0,
+    16, 4, 9, 0, 0, 26, 1, 108, 0, 0, 24, 2, 43, 0, 0,
+    18, 2, 15, 2, 16, 22, 2, 11, 2, 12, 18, 2, 68, 0, 0,
+    16, 4, 27, 0, 0, 24, 4, 19, 0, 0, 28, 4, 15, 0, 0,
+    20, 2, 78, 0, 0, 18, 4, 31, 0, 0, 18, 2, 14, 4, 15,
+    26, 4, 13, 1, 14, 24, 2, 97, 0, 0, 22, 2, 38, 2, 39,
+    22, 4, 18, 2, 19, 26, 4, 14, 2, 15, 30, 2, 116, 0, 0,
+    22, 3, 36, 2, 37, 20, 4, 16, 4, 17, 24, 4, 12, 4, 13,
+    18, 2, 68, 2, 69, 26, 4, 43, 1, 44, 24, 6, 19, 2, 20,
+    28, 6, 15, 2, 16, 20, 4, 81, 0, 0, 30, 1, 50, 4, 51,
+    28, 4, 22, 4, 23, 24, 3, 12, 8, 13, 24, 2, 92, 2, 93,
+    22, 6, 36, 2, 37, 26, 4, 20, 6, 21, 28, 7, 14, 4, 15,
+    26, 4, 107, 0, 0, 22, 8, 37, 1, 38, 24, 8, 20, 4, 21,
+    22, 12, 11, 4, 12, 30, 3, 115, 1, 116, 24, 4, 40, 5, 41,
+    20, 11, 16, 5, 17, 24, 11, 12, 5, 13, 22, 5, 87, 1, 88,
+    24, 5, 41, 5, 42, 30, 5, 24, 7, 25, 24, 11, 12, 7, 13,
+    24, 5, 98, 1, 99, 28, 7, 45, 3, 46, 24, 15, 19, 2, 20,
+    30, 3, 15, 13, 16, 28, 1, 107, 5, 108, 28, 10, 46, 1, 47,
+    28, 1, 22, 15, 23, 28, 2, 14, 17, 15, 30, 5, 120, 1, 121,
+    26, 9, 43, 4, 44, 28, 17, 22, 1, 23, 28, 2, 14, 19, 15,
+    28, 3, 113, 4, 114, 26, 3, 44, 11, 45, 26, 17, 21, 4, 22,
+    26, 9, 13, 16, 14, 28, 3, 107, 5, 108, 26, 3, 41, 13, 42,
+    30, 15, 24, 5, 25, 28, 15, 15, 10, 16, 28, 4, 116, 4, 117,
+    26, 17, 42, 0, 0, 28, 17, 22, 6, 23, 30, 19, 16, 6, 17,
+    28, 2, 111, 7, 112, 28, 17, 46, 0, 0, 30, 7, 24, 16, 25,
+    24, 34, 13, 0, 0, 30, 4, 121, 5, 122, 28, 4, 47, 14, 48,
+    30, 11, 24, 14, 25, 30, 16, 15, 14, 16, 30, 6, 117, 4, 118,
+    28, 6, 45, 14, 46, 30, 11, 24, 16, 25, 30, 30, 16, 2, 17,
+    26, 8, 106, 4, 107, 28, 8, 47, 13, 48, 30, 7, 24, 22, 25,
+    30, 22, 15, 13, 16, 28, 10, 114, 2, 115, 28, 19, 46, 4, 47,
+    28, 28, 22, 6, 23, 30, 33, 16, 4, 17, 30, 8, 122, 4, 123,
+    28, 22, 45, 3, 46, 30, 8, 23, 26, 24, 30, 12, 15, 28, 16,
+    30, 3, 117, 10, 118, 28, 3, 45, 23, 46, 30, 4, 24, 31, 25,
+    30, 11, 15, 31, 16, 30, 7, 116, 7, 117, 28, 21, 45, 7, 46,
+    30, 1, 23, 37, 24, 30, 19, 15, 26, 16, 30, 5, 115, 10, 116,
+    28, 19, 47, 10, 48, 30, 15, 24, 25, 25, 30, 23, 15, 25, 16,
+    30, 13, 115, 3, 116, 28, 2, 46, 29, 47, 30, 42, 24, 1, 25,
+    30, 23, 15, 28, 16, 30, 17, 115, 0, 0, 28, 10, 46, 23, 47,
+    30, 10, 24, 35, 25, 30, 19, 15, 35, 16, 30, 17, 115, 1, 116,
+    28, 14, 46, 21, 47, 30, 29, 24, 19, 25, 30, 11, 15, 46, 16,
+    30, 13, 115, 6, 116, 28, 14, 46, 23, 47, 30, 44, 24, 7, 25,
+    30, 59, 16, 1, 17, 30, 12, 121, 7, 122, 28, 12, 47, 26, 48,
+    30, 39, 24, 14, 25, 30, 22, 15, 41, 16, 30, 6, 121, 14, 122,
+    28, 6, 47, 34, 48, 30, 46, 24, 10, 25, 30, 2, 15, 64, 16,
+    30, 17, 122, 4, 123, 28, 29, 46, 14, 47, 30, 49, 24, 10, 25,
+    30, 24, 15, 46, 16, 30, 4, 122, 18, 123, 28, 13, 46, 32, 47,
+    30, 48, 24, 14, 25, 30, 42, 15, 32, 16, 30, 20, 117, 4, 118,
+    28, 40, 47, 7, 48, 30, 43, 24, 22, 25, 30, 10, 15, 67, 16,
+    30, 19, 118, 6, 119, 28, 18, 47, 31, 48, 30, 34, 24, 34, 25,
+    30, 20, 15, 61, 16,
+};
+
+// Data codewords for each version and error level
+static const uint16_t old_codeword_capacities[] = {
+    19, 16, 13, 9, 34, 28, 22, 16, 55, 44, 34, 26, 80, 64, 48, 36,
+    108, 86, 62, 46, 136, 108, 76, 60, 156, 124, 88, 66, 194, 154, 110, 86,
+    232, 182, 132, 100, 274, 216, 154, 122, 324, 254, 180, 140, 370, 290, 206, 158,
+    428, 334, 244, 180, 461, 365, 261, 197, 523, 415, 295, 223, 589, 453, 325, 253,
+    647, 507, 367, 283, 721, 563, 397, 313, 795, 627, 445, 341, 861, 669, 485, 385,
+    932, 714, 512, 406, 1006, 782, 568, 442, 1094, 860, 614, 464, 1174, 914, 664, 514,
+    1276, 1000, 718, 538, 1370, 1062, 754, 596, 1468, 1128, 808, 628, 1531, 1193, 871, 661,
+    1631, 1267, 911, 701, 1735, 1373, 985, 745, 1843, 1455, 1033, 793, 1955, 1541, 1115, 845,
+    2071, 1631, 1171, 901, 2191, 1725, 1231, 961, 2306, 1812, 1286, 986, 2434, 1914, 1354, 1054,
+    2566, 1992, 1426, 1096, 2702, 2102, 1502, 1142, 2812, 2216, 1582, 1222, 2956, 2334, 1666, 1276,
+};
+
+int test_version_table() {
+    printf("test_version_table()\n");
+
+    int success = 1;
+
+    success &= sizeof(VersionInfo) == 64;
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        const VersionInfo* info = get_version_info(ver);
+        const uint32_t side = (ver - 1) * 4 + 21;
+        int ok = info->side == side;
+
+        // Alignment patterns are spread evenly from the last one
+        // towards column 6, the first gap taking any slack
+        if (ver == 1) {
+            ok &= info->align_cnt == 0;
+        } else {
+            uint32_t cnt = ver / 7 + 2;
+            uint32_t step = (ver * 8 + cnt * 3 + 5) / (cnt * 4 - 4) * 2;
+            ok &= info->align_cnt == cnt && info->align_coords[0] == 6;
+            for (uint32_t i = 1; i < cnt; ++i)
+                ok &= info->align_coords[i] == side - 7 - (cnt - 1 - i) * step;
+        }
+
+        // Version information is a (18, 6) BCH code
+        uint32_t version_str = 0;
+        if (ver >= 7) {
+            uint32_t rem = ver << 12;
+            for (int32_t bit = 17; bit >= 12; --bit)
+                if (rem >> bit & 1)
+                    rem ^= 0x1f25 << (bit - 12);
+            version_str = ver << 12 | rem;
+        }
+        ok &= info->version_str == version_str;
+
+        const uint8_t numeric = ver < 10 ? 10 : ver < 27 ? 12 : 14;
+        ok &= info->char_cnt_bits[CHAR_CNT_NUMERIC] == numeric;
+        ok &= info->char_cnt_bits[CHAR_CNT_ALPHANUM] == numeric - 1;
+        ok &= info->char_cnt_bits[CHAR_CNT_BYTE] == (ver < 10 ? 8 : 16);
+
+        // Every error level fills the same codewords
+        for (ErrorLevel lvl = ERROR_LEVEL_LOW; lvl <= ERROR_LEVEL_HIGH; ++lvl) {
+            const BlockInfo b = info->blocks[lvl];
+            ok &= info->capacity[lvl] == b.block_cnt_1 * b.word_cnt_1 + b.block_cnt_2 * b.word_cnt_2;
+            ok &= info->total_words == info->capacity[lvl] + (b.block_cnt_1 + b.block_cnt_2) * b.err_cnt;
+            ok &= b.block_cnt_2 == 0 || b.word_cnt_2 == b.word_cnt_1 + 1;
+        }
+
+        // Every entry of the old tables is in the descriptor
+        const uint8_t* old_align = &old_align_pat_coords[7 * (ver - 2)];
+        for (uint32_t i = 0; ver > 1 && i < 7; ++i)
+            ok &= i < info->align_cnt ? info->align_coords[i] == old_align[i] : old_align[i] == 0;
+        for (ErrorLevel lvl = ERROR_LEVEL_LOW; lvl <= ERROR_LEVEL_HIGH; ++lvl) {
+            const uint8_t* entry = &old_error_table[20 * (ver - 1) + 5 * lvl];
+            const BlockInfo b = info->blocks[lvl];
+            ok &= b.err_cnt == entry[0] && b.block_cnt_1 == entry[1] && b.word_cnt_1 == entry[2];
+            ok &= b.block_cnt_2 == entry[3] && b.word_cnt_2 == entry[4];
+            ok &= info->capacity[lvl] == old_codeword_capacities[4 * (ver - 1) + lvl];
+        }
+
+        // The remainder bits are whatever the data modules have left
+        ok &= get_data_modules(ver)->count == info->total_words * 8u + info->remainder_bits;
+
+        if (!ok) {
+            printf("Mismatch: version %u\n", ver);
+            success = 0;
+        }
+    }
+
+    // Spot checks against the error correction table
+    const BlockInfo b5 = get_block_info(5, ERROR_LEVEL_QUARTILE);
+    success &= b5.err_cnt == 18 && b5.block_cnt_1 == 2 && b5.word_cnt_1 == 15 && b5.block_cnt_2 == 2 && b5.word_cnt_2 == 16;
+    const BlockInfo b40 = get_block_info(40, ERROR_LEVEL_HIGH);
+    success &= b40.err_cnt == 30 && b40.block_cnt_1 == 20 && b40.word_cnt_1 == 15 && b40.block_cnt_2 == 61 && b40.word_cnt_2 == 16;
+    success &= get_version_info(40)->capacity[ERROR_LEVEL_LOW] == 2956;
+
+    return success;
+}
+
+int test_qr_template() {
+    printf("test_qr_template()\n");
+
+    int success = 1;
+    QrMatrix* expected = (QrMatrix*)malloc(sizeof(QrMatrix));
+    QrMatrix* qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        init_matrix(expected, ver);
+        write_function_patterns(ver, expected);
+        if (ver > 6)
+            write_version_info(ver, expected);
+        write_format_bits(0, expected);
+
+        // Copies start from whatever was there before
+        memset(qr, 0xff, sizeof(QrMatrix));
+        write_qr_template(ver, qr);
+
+        const size_t words = expected->side * expected->row_words;
+        success &= get_qr_template(ver) == get_qr_template(ver);
+        success &= qr->side == expected->side && qr->row_words == expected->row_words;
+        success &= memcmp(qr->modules, expected->modules, words * sizeof(uint64_t)) == 0;
+        success &= memcmp(qr->reserved, expected->reserved, words * sizeof(uint64_t)) == 0;
+    }
+
+    free(qr);
+    free(expected);
+
+    return success;
+}
+
+int test_data_module_table() {
+    printf("test_data_module_table()\n");
+
+    int success = 1;
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        const DataModules* table = get_data_modules(ver);
+        const uint32_t side = (ver - 1) * 4 + 21;
+
+        // Only the remainder bits are left over after the message
+        uint32_t remainder = 0;
+        if (ver >= 2 && ver <= 6)
+            remainder = 7;
+        else if ((ver >= 14 && ver <= 20) || (ver >= 28 && ver <= 34))
+            remainder = 3;
+        else if (ver >= 21 && ver <= 27)
+            remainder = 4;
+        if (table->count != get_final_message_size(ver) * 8 + remainder) {
+            printf("Wrong module count: version %u\n", ver);
+            success = 0;
+        }
+
+        // Every data module is visited once and none is reserved
+        QrMatrix* qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+        init_matrix(qr, ver);
+        write_function_patterns(ver, qr);
+        if (ver > 6)
+            write_version_info(ver, qr);
+        write_format_info(ERROR_LEVEL_LOW, 0, qr);
+
+        for (uint32_t i = 0; i < table->count; ++i) {
+            const ModulePos pos = table->positions[i];
+            if (pos.x >= side || pos.y >= side || is_reserved(qr, pos.x, pos.y)) {
+                printf("Bad module: version %u index %u\n", ver, i);
+                success = 0;
+                break;
+            }
+            qr->reserved[pos.y * qr->row_words + pos.x / 64] |= (uint64_t)1 << (pos.x % 64);
+        }
+
+        for (uint32_t y = 0; y < side; ++y)
+            for (uint32_t x = 0; x < side; ++x)
+                success &= is_reserved(qr, x, y);
+
+        free(qr);
+    }
+
+    return success;
+}
+
+int test_strip_layout() {
+    printf("test_strip_layout()\n");
+
+    int success = 1;
+
+    // Message bytes that don't repeat along a strip
+    uint8_t data[3706 + 1];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = i * 131 + (i >> 8) * 7 + 1;
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        const DataModules* table = get_data_modules(ver);
+
+        // The data modules of a strip are in placement order
+        StripMatrix strips;
+        init_strip_matrix(&strips, ver);
+        uint32_t idx = 0;
+        for (uint32_t s = 0; s < strips.strip_cnt; ++s) {
+            for (uint32_t k = 0; k < 2 * strips.side; ++k) {
+                if (!(table->strips[s * strips.strip_words + k / 64] >> (k % 64) & 1))
+                    continue;
+                uint32_t x, y;
+                strip_step_pos(strips.side, s, k, &x, &y);
+                if (idx >= table->count || table->positions[idx].x != x || table->positions[idx].y != y) {
+                    printf("Strip out of order: version %u index %u\n", ver, idx);
+                    success = 0;
+                    s = strips.strip_cnt;
+                    break;
+                }
+                ++idx;
+            }
+        }
+        success &= idx == table->count;
+
+        // Placing through the strips matches placing row by row,
+        // for a full message and with remainder modules left over
+        const size_t sizes[2] = { table->count / 8, table->count / 8 / 3 };
+        for (uint32_t i = 0; i < 2; ++i) {
+            QrMatrix* expected = (QrMatrix*)malloc(sizeof(QrMatrix));
+            QrMatrix* result = (QrMatrix*)malloc(sizeof(QrMatrix));
+            write_qr_template(ver, expected);
+            write_qr_template(ver, result);
+
+            place_data_rows(ver, expected, data, sizes[i]);
+            place_data(ver, result, data, sizes[i]);
+
+            if (memcmp(expected->modules, result->modules, expected->side * expected->row_words * sizeof(uint64_t)) != 0) {
+                printf("Strip placement mismatch: version %u size %zu\n", ver, sizes[i]);
+                success = 0;
+            }
+
+            free(expected);
+            free(result);
+        }
+    }
+
+    return success;
+}
+
+int test_penalty_scoring() {
+    printf("test_penalty_scoring()\n");
+
+    int success = 1;
+    uint32_t seed = 7;
+    QrMatrix* qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        const uint32_t side = (ver - 1) * 4 + 21;
+
+        // Random modules, with long runs so every rule scores
+        init_matrix(qr, ver);
+        bool module = false;
+        for (uint32_t y = 0; y < side; ++y) {
+            for (uint32_t x = 0; x < side; ++x) {
+                seed = seed * 1103515245 + 12345;
+                if ((seed >> 16) % 4 == 0)
+                    module = !module;
+                set_module(qr, x, y, module);
+            }
+        }
+
+        uint64_t cols[MAX_SIDE * MAX_ROW_WORDS];
+        transpose_modules(qr, cols);
+        for (uint32_t y = 0; y < side; ++y)
+            for (uint32_t x = 0; x < side; ++x)
+                success &= (cols[x * qr->row_words + y / 64] >> (y % 64) & 1) == get_module(qr, x, y);
+
+        if (evaluate_qr(qr) != evaluate_qr_reference(qr)) {
+            printf("Penalty mismatch: random version %u\n", ver);
+            success = 0;
+        }
+
+        // Real qr codes with every mask
+        const size_t final_size = get_final_message_size(ver);
+        uint8_t* final = (uint8_t*)malloc(final_size);
+        for (size_t i = 0; i < final_size; ++i) {
+            seed = seed * 1103515245 + 12345;
+            final[i] = seed >> 16;
+        }
+        for (uint8_t m = 0; m < 8; ++m) {
+            write_qr_template(ver, qr);
+            write_masked_data(ver, ERROR_LEVEL_MEDIUM, m, qr, final, final_size);
+            if (evaluate_qr(qr) != evaluate_qr_reference(qr)) {
+                printf("Penalty mismatch: version %u mask %u\n", ver, m);
+                success = 0;
+            }
+        }
+        free(final);
+    }
+
+    free(qr);
+
+    return success;
+}
+
+int test_mask_planes() {
+    printf("test_mask_planes()\n");
+
+    int success = 1;
+    uint32_t seed = 11;
+
+    const MaskPlanes* planes = get_mask_planes();
+    for (uint8_t m = 0; m < 8; ++m)
+        for (uint32_t y = 0; y < MAX_SIDE; ++y)
+            for (uint32_t x = 0; x < MAX_SIDE; ++x)
+                success &= (planes->rows[m][y * MAX_ROW_WORDS + x / 64] >> (x % 64) & 1) == mask_pats[m](x, y);
+
+    // Masking a word at a time matches masking module by module
+    QrMatrix* qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+    QrMatrix* expected = (QrMatrix*)malloc(sizeof(QrMatrix));
+
+    for (Version ver = 1; ver <= 40; ++ver) {
+        const DataModules* table = get_data_modules(ver);
+        const size_t final_size = get_final_message_size(ver);
+        uint8_t* final = (uint8_t*)malloc(final_size);
+        for (size_t i = 0; i < final_size; ++i) {
+            seed = seed * 1103515245 + 12345;
+            final[i] = seed >> 16;
+        }
+
+        for (uint8_t m = 0; m < 8; ++m) {
+            write_qr_template(ver, qr);
+            write_masked_data(ver, ERROR_LEVEL_QUARTILE, m, qr, final, final_size);
+
+            write_qr_template(ver, expected);
+            write_format_info(ERROR_LEVEL_QUARTILE, m, expected);
+            for (uint32_t idx = 0; idx < table->count; ++idx) {
+                const ModulePos pos = table->positions[idx];
+                bool bit = idx < final_size * 8 && (final[idx / 8] >> (7 - idx % 8) & 1);
+                set_module(expected, pos.x, pos.y, bit ^ mask_pats[m](pos.x, pos.y));
+            }
+
+            if (memcmp(qr->modules, expected->modules, qr->side * qr->row_words * sizeof(uint64_t)) != 0) {
+                printf("Mismatch: version %u mask %u\n", ver, m);
+                success = 0;
+            }
+        }
+
+        free(final);
+    }
+
+    free(expected);
+    free(qr);
+
+    return success;
+}
+
+// The mask pattern of a qr code, from the format
+// information next to the bottom-left finder pattern
+uint8_t read_mask(const QrMatrix* qr) {
+    uint8_t mask = 0;
+    for (uint32_t i = 0; i < 3; ++i)
+        mask |= get_module(qr, 8, qr->side - 5 + i) << i;
+    return mask ^ 0b101;
+}
+
+int test_mask_strategies() {
+    printf("test_mask_strategies()\n");
+
+    int success = 1;
+    uint32_t seed = 13;
+
+    for (Version ver = 1; ver <= 40; ver += 3) {
+        for (ErrorLevel lvl = ERROR_LEVEL_LOW; lvl <= ERROR_LEVEL_HIGH; ++lvl) {
+            const size_t final_size = get_final_message_size(ver);
+            uint8_t* final = (uint8_t*)malloc(final_size);
+            for (size_t i = 0; i < final_size; ++i) {
+                seed = seed * 1103515245 + 12345;
+                final[i] = seed >> 16;
+            }
+
+            MaskReport optimal_report, bounded_report;
+            QrMatrix* optimal = create_qr(ver, lvl, MASK_OPTIMAL, final, final_size, &optimal_report);
+            QrMatrix* bounded = create_qr(ver, lvl, MASK_BOUNDED, final, final_size, &bounded_report);
+            const size_t words = optimal->side * optimal->row_words;
+
+            // Bounding only skips work, never changes the choice
+            success &= optimal_report.masks_scored == 8 && optimal_report.lines_skipped == 0;
+            success &= bounded_report.mask == optimal_report.mask;
+            success &= bounded_report.penalty == optimal_report.penalty;
+            success &= bounded_report.lines_scored + bounded_report.lines_skipped == optimal_report.lines_scored;
+            success &= read_mask(optimal) == optimal_report.mask;
+            success &= evaluate_qr(optimal) == optimal_report.penalty;
+            success &= memcmp(optimal->modules, bounded->modules, words * sizeof(uint64_t)) == 0;
+
+            for (uint8_t m = 0; m < 8; ++m) {
+                MaskReport fixed_report;
+                QrMatrix* fixed = create_qr(ver, lvl, MASK_FIXED(m), final, final_size, &fixed_report);
+                success &= fixed_report.mask == m && fixed_report.lines_scored == 0;
+                success &= read_mask(fixed) == m;
+                free(fixed);
+            }
+
+            free(bounded);
+            free(optimal);
+            free(final);
+        }
+    }
+
+    uint8_t final[26] = { 0 };
+    success &= create_qr(1, ERROR_LEVEL_LOW, 10, final, sizeof(final), NULL) == NULL;
+
+    return success;
+}
+
+int test_update_qr() {
+    printf("test_update_qr()\n");
+
+    int success = 1;
+    uint32_t seed = 5;
+
+    const Version versions[] = { 5, 12 };
+    for (uint32_t v = 0; v < 2; ++v) {
+        Version ver = versions[v];
+        ErrorLevel lvl = v == 0 ? ERROR_LEVEL_QUARTILE : ERROR_LEVEL_MEDIUM;
+        const uint32_t side = (ver - 1) * 4 + 21;
+
+        const BlockInfo info = get_block_info(ver, lvl);
+        const size_t msg_len = (size_t)info.block_cnt_1 * info.word_cnt_1 + (size_t)info.block_cnt_2 * info.word_cnt_2;
+        const size_t final_size = get_final_message_size(ver);
+
+        uint8_t* msg = (uint8_t*)malloc(msg_len);
+        for (size_t i = 0; i < msg_len; ++i) {
+            seed = seed * 1103515245 + 12345;
+            msg[i] = seed >> 16;
+        }
+
+        uint8_t* final = get_final_message(msg, msg_len, ver, lvl);
+        QrMatrix* qr = create_qr(ver, lvl, MASK_OPTIMAL, final, final_size, NULL);
+
+        // A serial counter, plus a codeword in the last block
+        CodewordEdit edits[] = {
+            { 10, msg[10] + 1 },
+            { 11, msg[11] ^ 0x5a },
+            { msg_len - 1, msg[msg_len - 1] ^ 0xff },
+        };
+        for (uint32_t e = 0; e < 3; ++e)
+            msg[edits[e].index] = edits[e].value;
+
+        success &= update_qr(ver, lvl, qr, final, edits, 3);
+
+        // update_qr() keeps the mask, so build the expected
+        // qr code with the mask create_qr() picked
+        uint8_t* expected_final = get_final_message(msg, msg_len, ver, lvl);
+        QrMatrix* expected_qr = (QrMatrix*)malloc(sizeof(QrMatrix));
+        write_qr_template(ver, expected_qr);
+        write_masked_data(ver, lvl, read_mask(qr), expected_qr, expected_final, final_size);
+
+        success &= memcmp(final, expected_final, final_size) == 0;
+        success &= memcmp(qr->modules, expected_qr->modules, side * qr->row_words * sizeof(uint64_t)) == 0;
+
+        // A bad edit after good ones changes nothing
+        CodewordEdit bad_edits[] = {
+            { 3, msg[3] ^ 0x81 },
+            { msg_len, 0 },
+        };
+        success &= !update_qr(ver, lvl, qr, final, bad_edits, 2);
+        success &= memcmp(final, expected_final, final_size) == 0;
+        success &= memcmp(qr->modules, expected_qr->modules, side * qr->row_words * sizeof(uint64_t)) == 0;
+
+        free(expected_qr);
+        free(expected_final);
+        free(qr);
+        free(final);
+        free(msg);
+    }
 
     return success;
 }
@@ -64,10 +820,10 @@ int test_qr_image_write() {
 
     Version ver = 5;
     ErrorLevel lvl = ERROR_LEVEL_QUARTILE;
-    uint8_t* qr = create_qr(ver, lvl, data, sizeof(data));
+    QrMatrix* qr = create_qr(ver, lvl, MASK_OPTIMAL, data, sizeof(data), NULL);
     printf("Created QR code!\n");
-    print_qr(qr, ver);
-    write_qr("qr.bmp", 1000, qr, ver);
+    print_qr(qr);
+    write_qr("qr.bmp", 1000, qr);
     free(qr);
 #else
     printf("QR WRITE TEST\n");
@@ -109,10 +865,10 @@ int test_qr_image_write() {
 
     uint8_t* final = get_final_message(msg, sizeof(msg), ver, lvl);
 
-    uint8_t* qr = create_qr(ver, lvl, final, sizeof(expected));
+    QrMatrix* qr = create_qr(ver, lvl, MASK_OPTIMAL, final, sizeof(expected), NULL);
     printf("Created QR code!\n");
-    print_qr(qr, ver);
-    write_qr("qr.bmp", 1000, qr, ver);
+    print_qr(qr);
+    write_qr("qr.bmp", 1000, qr);
 
     free(qr);
     free(final);
@@ -122,11 +878,20 @@ int test_qr_image_write() {
 }
 
 int main() {
-    init_finite_field();
-    init_generators();
-
     int success = 1;
     success &= test_word_generation();
+    success &= test_word_generation_kernels();
+    success &= test_final_message_layout();
+    success &= test_batch_final_message();
+    success &= test_message_prefix();
+    success &= test_version_table();
+    success &= test_qr_template();
+    success &= test_data_module_table();
+    success &= test_strip_layout();
+    success &= test_penalty_scoring();
+    success &= test_mask_planes();
+    success &= test_mask_strategies();
+    success &= test_update_qr();
     success &= test_qr_image_write();
     if (success) {
         printf("ALL TESTS COMPLETED SUCCESSFULLY!\n");
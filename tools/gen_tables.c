@@ -0,0 +1,184 @@
+// Generates the Galois field and generator polynomial
+// tables used by src/error.c as constant data
+// Usage: gen_tables <output header>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// For MAX_EC_WORDS and RS_WORDS, which the tables are laid out by
+#include "error.h"
+
+// raises 2^x in GF(2^8)
+static uint8_t ff_exp[255];
+// retrieves exponent of field element
+static uint8_t ff_log[256];
+
+void init_finite_field() {
+    // p(x) = x^8 + x^4 + x^3 + x^2 + 1
+
+    uint8_t a8 = 0b00011101; // a^4 + a^3 + a^2 + 1
+    uint8_t a  = 0b00000001; // 1
+
+    for (int i = 0; i < 255; ++i) {
+        ff_log[a] = i;
+        ff_exp[i] = a;
+        bool is_degree_7 = a & (1 << 7);
+        a <<= 1;
+        if (is_degree_7)
+            a ^= a8;
+    }
+}
+
+#define MAX_GEN_DEG 68
+// Degrees 1 to 68, each with (degree + 1) coefficients
+#define GEN_COEFFICIENT_CNT ((MAX_GEN_DEG * MAX_GEN_DEG + 3 * MAX_GEN_DEG) / 2)
+static uint8_t gen_coefficients[GEN_COEFFICIENT_CNT];
+
+void init_generators() {
+    // Determines the coefficients
+    // to the generator polynomials
+    // Biggest degree is 68
+
+    // Initialize the generators with polynomial degree 1
+    // (x - a^0) = (a^0*x - a^0)
+    size_t offset = 2;
+
+    // Generate polynomials up to and including degree 68
+    for (uint32_t deg = 2; deg <= MAX_GEN_DEG; ++deg) {
+        // First coefficient is always 1 or a^0
+        gen_coefficients[offset] = 0;
+        offset++;
+
+        for (uint32_t i = 0; i < deg - 1; ++i) {
+            uint8_t a = gen_coefficients[offset + i - deg];
+            uint8_t b = gen_coefficients[offset + i - deg - 1];
+            gen_coefficients[offset + i] = ff_log[ff_exp[a] ^ ff_exp[(b + deg - 1) % 255]];
+        }
+
+        uint8_t b = gen_coefficients[offset - 2];
+        gen_coefficients[offset + deg - 1] = (b + deg - 1) % 255;
+
+        offset += deg;
+    }
+}
+
+// The number of error correction codewords in a block
+// is always one of these (see error_table in module.c)
+static const uint8_t ec_word_counts[] = {
+    7, 10, 13, 15, 16, 17, 18, 20, 22, 24, 26, 28, 30,
+};
+
+#define EC_COUNT_CNT (sizeof(ec_word_counts) / sizeof(ec_word_counts[0]))
+
+// Product tables for the shift register encoder
+// gen_tables[slot][f] is the generator polynomial (without its
+// leading term) multiplied by the feedback value f, packed like
+// the remainder so that one step is a shift and 4 xors
+static uint64_t gen_tables[EC_COUNT_CNT][256][RS_WORDS];
+// Maps an error codeword count to its slot in gen_tables, or -1
+static int8_t gen_table_slots[MAX_EC_WORDS + 1];
+
+void init_gen_tables() {
+    memset(gen_table_slots, -1, sizeof(gen_table_slots));
+
+    for (uint32_t slot = 0; slot < EC_COUNT_CNT; ++slot) {
+        uint32_t deg = ec_word_counts[slot];
+        gen_table_slots[deg] = slot;
+
+        // Skip the leading coefficient, it is always 1
+        const uint8_t* gen = &gen_coefficients[(deg * deg + deg) / 2 - 1] + 1;
+
+        for (uint32_t f = 1; f < 256; ++f) {
+            uint64_t* row = gen_tables[slot][f];
+            for (uint32_t j = 0; j < deg; ++j) {
+                uint64_t term = ff_exp[(gen[j] + ff_log[f]) % 255];
+                row[j / 8] |= term << (8 * (j % 8));
+            }
+        }
+    }
+}
+
+// Nibble multiplication tables for the vectorized multiply
+// gf_nibble_tables[c][0][n] = c * n
+// gf_nibble_tables[c][1][n] = c * (n << 4)
+// so c * x = gf_nibble_tables[c][0][x & 15] ^ gf_nibble_tables[c][1][x >> 4],
+// which is two 16-entry byte shuffles
+static uint8_t gf_nibble_tables[256][2][16];
+
+uint8_t ff_multiply(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0)
+        return 0;
+
+    return ff_exp[(ff_log[a] + ff_log[b]) % 255];
+}
+
+void init_nibble_tables() {
+    for (uint32_t c = 0; c < 256; ++c) {
+        for (uint32_t n = 0; n < 16; ++n) {
+            gf_nibble_tables[c][0][n] = ff_multiply(c, n);
+            gf_nibble_tables[c][1][n] = ff_multiply(c, n << 4);
+        }
+    }
+}
+
+void write_bytes(FILE* f, const char* decl, const uint8_t* data, size_t size) {
+    fprintf(f, "%s = {", decl);
+    for (size_t i = 0; i < size; ++i)
+        fprintf(f, "%s%u,", i % 16 == 0 ? "\n    " : " ", data[i]);
+    fprintf(f, "\n};\n\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        printf("Usage: %s <output header>\n", argv[0]);
+        return 1;
+    }
+
+    init_finite_field();
+    init_generators();
+    init_gen_tables();
+    init_nibble_tables();
+
+    FILE* f = fopen(argv[1], "w");
+    if (!f) {
+        printf("gen_tables: Could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(f, "// Generated by tools/gen_tables.c, do not edit\n\n");
+    fprintf(f, "#define MAX_GEN_DEG %d\n", MAX_GEN_DEG);
+    fprintf(f, "#define GEN_COEFFICIENT_CNT %d\n", GEN_COEFFICIENT_CNT);
+    fprintf(f, "#define EC_COUNT_CNT %zu\n\n", EC_COUNT_CNT);
+
+    write_bytes(f, "static const uint8_t ff_exp[255]", ff_exp, sizeof(ff_exp));
+    write_bytes(f, "static const uint8_t ff_log[256]", ff_log, sizeof(ff_log));
+    write_bytes(f, "static const uint8_t gen_coefficients[GEN_COEFFICIENT_CNT]", gen_coefficients, sizeof(gen_coefficients));
+    write_bytes(f, "static const uint8_t ec_word_counts[EC_COUNT_CNT]", ec_word_counts, sizeof(ec_word_counts));
+
+    fprintf(f, "static const int8_t gen_table_slots[MAX_EC_WORDS + 1] = {\n   ");
+    for (uint32_t i = 0; i <= MAX_EC_WORDS; ++i)
+        fprintf(f, " %d,", gen_table_slots[i]);
+    fprintf(f, "\n};\n\n");
+
+    write_bytes(f, "static const uint8_t gf_nibble_tables[256][2][16] __attribute__((aligned(16)))",
+        &gf_nibble_tables[0][0][0], sizeof(gf_nibble_tables));
+
+    fprintf(f, "static const uint64_t gen_tables[EC_COUNT_CNT][256][RS_WORDS] = {\n");
+    for (uint32_t slot = 0; slot < EC_COUNT_CNT; ++slot) {
+        fprintf(f, "    { // %u error correction codewords\n", ec_word_counts[slot]);
+        for (uint32_t v = 0; v < 256; ++v) {
+            const uint64_t* row = gen_tables[slot][v];
+            fprintf(f, "        { 0x%016llxull, 0x%016llxull, 0x%016llxull, 0x%016llxull },\n",
+                (unsigned long long)row[0], (unsigned long long)row[1],
+                (unsigned long long)row[2], (unsigned long long)row[3]);
+        }
+        fprintf(f, "    },\n");
+    }
+    fprintf(f, "};\n");
+
+    fclose(f);
+
+    return 0;
+}